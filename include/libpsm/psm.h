@@ -66,6 +66,23 @@ void __attribute__((visibility("default"))) * psm_reserve(size_t len);
 void __attribute__((visibility("default"))) psm_push(const void *log_entry, size_t len);
 void __attribute__((visibility("default"))) psm_commit(bool push_only);
 
+/* Volatile memory is not crash-consistent: it stays in DRAM, and writes to it are not undo-logged.
+ * Its content after recovery is unspecified.  Use it for scratch space and caches that can be rebuilt.
+ * Both functions must be called before `psm_init`. */
+
+/* Marks the pages that lie entirely within [addr, addr + len) as volatile.  Returns 0, or an errno. */
+int __attribute__((visibility("default"))) psm_volatile_region(void *addr, size_t len);
+/* Allocates `len` bytes of zeroed, page-aligned volatile memory.  Returns NULL on failure. */
+void __attribute__((visibility("default"))) * psm_volatile_alloc(size_t len);
+
+/* Calls `func(arg)` and returns its result.  In the background, `func` runs natively, i.e., its writes are
+ * not recorded automatically; instead, it must call `psm_undo_declare` on everything it's about to modify.
+ * `func` must not map or unmap memory.  Use this for hot operations whose write set is known exactly. */
+int __attribute__((visibility("default"))) psm_undo_trusted_call(consume_func_t func, const void *arg);
+/* Declares that the calling trusted function (see `psm_undo_trusted_call`) is about to modify
+ * [addr, addr + len).  Elsewhere, this is a no-op, since writes are recorded automatically. */
+void __attribute__((visibility("default"))) psm_undo_declare(void *addr, size_t len);
+
 #ifdef __cplusplus
 }
 #endif
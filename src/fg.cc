@@ -19,6 +19,7 @@
 #include "chkpt/chkpt.h"
 #include "internal.h"
 #include "undo/flush.h"
+#include "undo/undo_bg.h"
 #include "undo/undo_fg.h"
 
 static const char *PSM_LOG_FILE_NAME = "psm_log";
@@ -175,6 +176,39 @@ int psm_init(const psm_config_t *config) {
     return 0;
 }
 
+int psm_volatile_region(void *addr, size_t len) {
+    if (p_psm != nullptr) { // The background process would miss it.
+        return EBUSY;
+    }
+    if (addr == nullptr || len == 0) {
+        return EINVAL;
+    }
+    if (instrument_args.num_volatile_regions == MAX_VOLATILE_REGIONS) {
+        return ENOMEM;
+    }
+    instrument_args.volatile_regions[instrument_args.num_volatile_regions++] = {addr, len};
+    return 0;
+}
+
+void *psm_volatile_alloc(size_t len) {
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    len = (len + page_size - 1) & ~(page_size - 1);
+    void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        return nullptr;
+    }
+    if (psm_volatile_region(mem, len) != 0) {
+        munmap(mem, len);
+        return nullptr;
+    }
+    return mem;
+}
+
+// Replaced in the background (see `instrument.cc`).
+int psm_undo_trusted_call(consume_func_t func, const void *arg) { return func(arg); }
+
+void psm_undo_declare(void *addr, size_t len) { instrument_declare_write(addr, len); }
+
 void *psm_reserve(size_t len) {
     len = align_to_cache_line_size(len);
 
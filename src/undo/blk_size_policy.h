@@ -0,0 +1,271 @@
+#ifndef PSM_SRC_UNDO_BLK_SIZE_POLICY_H
+#define PSM_SRC_UNDO_BLK_SIZE_POLICY_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "dr_api.h"
+
+#include "mem_region/mem_region.h"
+
+// Picks the undo block size for each managed region based on the writes observed in it.
+// Small blocks suit scattered small updates (e.g., 8-byte counters), which would otherwise log
+// mostly unmodified bytes; large blocks suit bulk writes, which would otherwise need many entries.
+//
+// Writes are observed through the undo log at commit (see `sample`), which has every block logged since the
+// previous commit, whether by the inlined fast path or by the slow path.  Comparing a block's original content
+// with its current content tells which of its words were modified, and so which blocks each block size would
+// have logged.
+//
+// A region's block size only changes at commit (see `adapt`), so all entries for a block in one
+// undo log have the same size, and blocks logged in the same undo log never partially overlap.
+class blk_size_policy {
+  public:
+    // Every block (and the entry header) must fit in one undo log entry.
+    static constexpr size_t BLK_SIZES_B[] = {8, 16, 32};
+    static constexpr int NUM_BLK_SIZES = sizeof(BLK_SIZES_B) / sizeof(BLK_SIZES_B[0]);
+    static constexpr int DEFAULT_BLK_SIZE_IDX = NUM_BLK_SIZES - 1;
+
+    // Estimated cost of an entry other than the block content: the header, and flushing a log entry.
+    static constexpr uint64_t ENTRY_OVERHEAD_B = 32;
+    // Logged blocks are sampled by the aligned group of the largest block size ("super-block") they're in: one in
+    // this many super-blocks is sampled, along with all the blocks logged in it.
+    static constexpr uint64_t SAMPLE_PERIOD = 8;
+    // At most this many logged blocks are sampled per commit.
+    static constexpr size_t MAX_SAMPLES = 1024;
+    // A region's block size is reconsidered once this many super-blocks have been observed.
+    static constexpr uint64_t MIN_SAMPLES = 256;
+
+    struct region {
+        uintptr_t start;
+        size_t size;
+
+        int blk_size_idx; // Index into BLK_SIZES_B.
+        uint64_t num_samples;
+        // `cost[i]` is the estimated cost (in bytes) of logging the observed writes with block size
+        // `BLK_SIZES_B[i]`: each block modified costs its size plus the per-entry overhead.
+        uint64_t cost[NUM_BLK_SIZES];
+
+        [[nodiscard]] bool includes(uintptr_t addr) const { return start <= addr && addr - start < size; }
+
+        // Observes a super-block, where bit `w` of `modified` is set if its `w`-th word was modified.
+        void observe(uint32_t modified) {
+            ++num_samples;
+            for (int i = 0; i < NUM_BLK_SIZES; i++) {
+                const size_t words_per_blk = BLK_SIZES_B[i] / WORD_B;
+                const uint32_t blk_mask = (1u << words_per_blk) - 1;
+                uint64_t num_blks = 0;
+                for (size_t w = 0; w < WORDS_PER_SUPER_BLK; w += words_per_blk) {
+                    num_blks += (modified >> w) & blk_mask ? 1 : 0;
+                }
+                // Rewriting a block with its own content still logs it.
+                cost[i] += std::max<uint64_t>(num_blks, 1) * (BLK_SIZES_B[i] + ENTRY_OVERHEAD_B);
+            }
+        }
+    };
+
+    blk_size_policy() : regions(nullptr), num_regions(0), last(nullptr), managed(nullptr), num_pending(0) {}
+
+    ~blk_size_policy() { free_regions(regions, num_regions); }
+
+    blk_size_policy(const blk_size_policy &) = delete;
+    blk_size_policy &operator=(const blk_size_policy &) = delete;
+
+    // Rebuilds the set of regions from the memory region manager, keeping what has been learned
+    // about regions that still exist.  Should only be called when the undo log is empty.
+    void reset_regions(const mem_region_manager &mrm) {
+        managed = &mrm.managed_pages();
+        for (size_t i = 0; i < num_regions; i++) {
+            if (regions[i].blk_size_idx != DEFAULT_BLK_SIZE_IDX) {
+                non_default.remove(regions[i].start, regions[i].size);
+            }
+        }
+
+        size_t new_num_regions = 0;
+        mrm.foreach_region([&new_num_regions](const region_t &) { ++new_num_regions; });
+
+        auto new_regions = static_cast<region *>(dr_global_alloc(sizeof(region) * std::max<size_t>(new_num_regions, 1)));
+        size_t i = 0;
+        mrm.foreach_region([new_regions, &i](const region_t &r) {
+            new (&new_regions[i++]) region{reinterpret_cast<uintptr_t>(r.base), r.size, DEFAULT_BLK_SIZE_IDX, 0, {}};
+        });
+        std::sort(new_regions, new_regions + new_num_regions,
+                  [](const region &a, const region &b) { return a.start < b.start; });
+
+        for (i = 0; i < new_num_regions; i++) {
+            region *old = find_in(regions, num_regions, new_regions[i].start);
+            if (old != nullptr && old->start == new_regions[i].start && old->size == new_regions[i].size) {
+                new_regions[i] = *old;
+            }
+            if (new_regions[i].blk_size_idx != DEFAULT_BLK_SIZE_IDX) {
+                non_default.insert(new_regions[i].start, new_regions[i].size);
+            }
+        }
+
+        free_regions(regions, num_regions);
+        regions = new_regions;
+        num_regions = new_num_regions;
+        last = nullptr;
+    }
+
+    // Returns the region containing `addr`, or nullptr if `addr` is not in a managed region.
+    [[gnu::always_inline]] inline region *find(uintptr_t addr) {
+        if (last != nullptr && last->includes(addr)) {
+            return last;
+        }
+        region *r = find_in(regions, num_regions, addr);
+        if (r != nullptr && r->includes(addr)) {
+            last = r;
+            return r;
+        }
+        return nullptr;
+    }
+
+    // Returns the region containing `addr` (or nullptr), and shrinks `*size` so that [addr, addr + *size) stays
+    // within it (or, if `addr` is not in a region, ends before the next region).
+    [[gnu::always_inline]] inline region *find_segment(uintptr_t addr, size_t *size) {
+        if (region *r = find(addr)) {
+            *size = std::min<size_t>(*size, r->start + r->size - addr);
+            return r;
+        }
+        region *prev = find_in(regions, num_regions, addr);
+        region *next = prev == nullptr ? regions : prev + 1;
+        if (next < regions + num_regions && next->start - addr < *size) {
+            *size = next->start - addr;
+        }
+        return nullptr;
+    }
+
+    // The pages of regions that don't use the default block size, for the inlined fast path to check.
+    // Its address never changes.
+    [[nodiscard]] const page_map &non_default_pages() const { return non_default; }
+
+    // Called at commit on each block logged since the previous commit, of `blk_size` bytes at `addr`, whose
+    // original content is at `original` (or, if null, was all zeros).
+    void sample(uintptr_t addr, size_t blk_size, const void *original) {
+        const uintptr_t super_blk = addr & ~(SUPER_BLK_B - 1);
+        if ((super_blk / SUPER_BLK_B * 0x9E3779B97F4A7C15ull) >> 60 >= 16 / SAMPLE_PERIOD) {
+            return;
+        }
+        // The block's memory might have been unmapped since it was logged.
+        if (num_pending == MAX_SAMPLES || managed == nullptr || !managed->test(addr)) {
+            return;
+        }
+        uint32_t modified = 0;
+        for (size_t off = 0; off < blk_size; off += WORD_B) {
+            uint64_t before = 0, after;
+            if (original != nullptr) {
+                memcpy(&before, static_cast<const char *>(original) + off, WORD_B);
+            }
+            memcpy(&after, reinterpret_cast<const void *>(addr + off), WORD_B);
+            if (before != after) {
+                modified |= 1u << ((addr - super_blk + off) / WORD_B);
+            }
+        }
+        pending[num_pending++] = {super_blk, modified};
+    }
+
+    // Picks a new block size for regions with enough samples.  Should only be called when the undo
+    // log is empty.
+    void adapt() {
+        // The blocks sampled in a super-block are merged, so that each block size is charged for the blocks it
+        // would have logged in it.
+        std::sort(pending, pending + num_pending,
+                  [](const pending_sample &a, const pending_sample &b) { return a.super_blk < b.super_blk; });
+        for (size_t i = 0; i < num_pending;) {
+            size_t j = i;
+            uint32_t modified = 0;
+            for (; j < num_pending && pending[j].super_blk == pending[i].super_blk; j++) {
+                modified |= pending[j].modified;
+            }
+            if (region *r = find(pending[i].super_blk)) {
+                r->observe(modified);
+            }
+            i = j;
+        }
+        num_pending = 0;
+
+        for (size_t i = 0; i < num_regions; i++) {
+            region *r = &regions[i];
+            if (r->num_samples < MIN_SAMPLES) {
+                continue;
+            }
+
+            // Ties go to the larger block size, which needs fewer entries.
+            int best = DEFAULT_BLK_SIZE_IDX;
+            for (int j = NUM_BLK_SIZES - 1; j >= 0; j--) {
+                if (r->cost[j] < r->cost[best]) {
+                    best = j;
+                }
+            }
+#if INSTRUMENT_LOGGING
+            if (best != r->blk_size_idx) {
+                dr_fprintf(STDERR, "[bg: blk_size_policy::adapt] %p: block size %lu -> %lu\n", r->start,
+                           BLK_SIZES_B[r->blk_size_idx], BLK_SIZES_B[best]);
+            }
+#endif
+            if ((r->blk_size_idx == DEFAULT_BLK_SIZE_IDX) != (best == DEFAULT_BLK_SIZE_IDX)) {
+                if (best == DEFAULT_BLK_SIZE_IDX) {
+                    non_default.remove(r->start, r->size);
+                } else {
+                    non_default.insert(r->start, r->size);
+                }
+            }
+            r->blk_size_idx = best;
+
+            // Decay, so that the policy follows changes in the workload.
+            r->num_samples /= 2;
+            for (auto &c : r->cost) {
+                c /= 2;
+            }
+        }
+    }
+
+  private:
+    using region_t = ::region;
+
+    static constexpr size_t WORD_B = sizeof(uint64_t);
+    static constexpr size_t SUPER_BLK_B = BLK_SIZES_B[NUM_BLK_SIZES - 1];
+    static constexpr size_t WORDS_PER_SUPER_BLK = SUPER_BLK_B / WORD_B;
+    static_assert(BLK_SIZES_B[0] >= WORD_B, "blocks smaller than a word");
+    static_assert(16 % SAMPLE_PERIOD == 0, "SAMPLE_PERIOD should divide 16");
+
+    struct pending_sample {
+        uintptr_t super_blk;
+        uint32_t modified; // Bit `w` is set if the super-block's `w`-th word was modified.
+    };
+
+    region *regions; // Sorted by start; disjoint.
+    size_t num_regions;
+    region *last; // The region found by the previous lookup (if any).
+    page_map non_default;
+    const page_map *managed; // Owned by the memory region manager.
+    // Blocks sampled since the previous commit.
+    pending_sample pending[MAX_SAMPLES];
+    size_t num_pending;
+
+    // Returns the last region with start <= `addr` (which may or may not contain `addr`), or nullptr.
+    static region *find_in(region *rs, size_t n, uintptr_t addr) {
+        size_t lo = 0, hi = n;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (rs[mid].start <= addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo == 0 ? nullptr : &rs[lo - 1];
+    }
+
+    static void free_regions(region *rs, size_t n) {
+        if (rs != nullptr) {
+            dr_global_free(rs, sizeof(region) * std::max<size_t>(n, 1));
+        }
+    }
+};
+
+#endif // PSM_SRC_UNDO_BLK_SIZE_POLICY_H
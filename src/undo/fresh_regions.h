@@ -0,0 +1,245 @@
+#ifndef PSM_SRC_UNDO_FRESH_REGIONS_H
+#define PSM_SRC_UNDO_FRESH_REGIONS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+
+#include "dr_api.h"
+#include "drvector.h"
+
+#include "mem_region/page_map.h"
+
+// Memory regions allocated since the previous commit.  Writes to these regions are not undo-logged;
+// instead, each region keeps a bitmap of the cache lines written to, so that commit only needs to flush
+// those lines (rather than the entire region).
+// The pages overlapping fresh regions are also kept in a `page_map`, so that instrumentation code can
+// tell cheaply whether a write might be to a fresh region.
+class fresh_regions {
+    static constexpr size_t LINE_SIZE_B = 64;
+    static constexpr size_t BITS_PER_WORD = 64;
+
+  public:
+    struct region {
+        uintptr_t start;
+        size_t size;
+        uint64_t *dirty; // Bit i is set if the line at `line_base() + i * LINE_SIZE_B` has been written to.
+
+        [[nodiscard]] uintptr_t end() const { return start + size; }
+        [[nodiscard]] uintptr_t line_base() const { return start & ~(LINE_SIZE_B - 1); }
+        [[nodiscard]] size_t num_lines() const { return (end() - line_base() + LINE_SIZE_B - 1) / LINE_SIZE_B; }
+        [[nodiscard]] size_t num_words() const { return (num_lines() + BITS_PER_WORD - 1) / BITS_PER_WORD; }
+
+        [[nodiscard]] bool includes(uintptr_t addr, size_t len) const {
+            return start <= addr && addr - start + len <= size;
+        }
+    };
+
+    fresh_regions() : v{} {
+        bool success = drvector_init(&v, /* initial capacity */ 10, false, nullptr);
+        DR_ASSERT(success);
+    }
+
+    ~fresh_regions() {
+        clear();
+        bool success = drvector_delete(&v);
+        DR_ASSERT(success);
+    }
+
+    // Adjacent and overlapping regions are coalesced, so that a write straddling two `mmap` calls
+    // is still recognized as fresh.
+    void insert(uintptr_t start, size_t size) {
+        if (size == 0) {
+            return;
+        }
+
+        uintptr_t new_start = start, new_end = start + size;
+        uint first = lower_bound(start);
+        if (first > 0 && at(first - 1)->end() >= start) {
+            --first;
+        }
+        uint last = first; // Exclusive.
+        for (; last < v.entries && at(last)->start <= new_end; ++last) {
+            new_start = std::min(new_start, at(last)->start);
+            new_end = std::max(new_end, at(last)->end());
+        }
+
+        pages.insert(start, size);
+        region *merged = new_region(new_start, new_end - new_start);
+        for (uint i = first; i < last; i++) {
+            copy_dirty(merged, at(i));
+            free_region(at(i));
+        }
+        splice(first, last, &merged, 1);
+    }
+
+    // Returns the region that includes all of [start, start + size), or nullptr if there's none.
+    [[nodiscard]] region *find(uintptr_t start, size_t size) const {
+        uint i = lower_bound(start + 1);
+        if (i == 0) {
+            return nullptr;
+        }
+        region *r = at(i - 1);
+        return r->includes(start, size) ? r : nullptr;
+    }
+
+    // Marks lines overlapping [start, start + size) as dirty.  Expects `r` to include the range.
+    static void mark_dirty(region *r, uintptr_t start, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        size_t first = (start - r->line_base()) / LINE_SIZE_B;
+        size_t last = (start + size - 1 - r->line_base()) / LINE_SIZE_B;
+        if (first == last) { // The common case.
+            r->dirty[first / BITS_PER_WORD] |= 1ull << (first % BITS_PER_WORD);
+            return;
+        }
+        set_bits(r->dirty, first, last);
+    }
+
+    void remove(uintptr_t start, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        const uintptr_t end = start + size;
+
+        uint first = lower_bound(start);
+        if (first > 0 && at(first - 1)->end() > start) {
+            --first;
+        }
+        uint last = first; // Exclusive.
+        for (; last < v.entries && at(last)->start < end; ++last)
+            ;
+        if (first == last) {
+            return;
+        }
+        pages.remove(start, size);
+
+        // At most the first region has a left remainder, and at most the last one has a right remainder.
+        region *remainders[2];
+        int num_remainders = 0;
+        region *l = at(first), *r = at(last - 1);
+        if (l->start < start) {
+            remainders[num_remainders] = new_region(l->start, start - l->start);
+            copy_dirty(remainders[num_remainders++], l);
+        }
+        if (r->end() > end) {
+            remainders[num_remainders] = new_region(end, r->end() - end);
+            copy_dirty(remainders[num_remainders++], r);
+        }
+        for (uint i = first; i < last; i++) {
+            free_region(at(i));
+        }
+        splice(first, last, remainders, num_remainders);
+        // A page may be shared between the removed range and a remainder.
+        for (int i = 0; i < num_remainders; i++) {
+            pages.insert(remainders[i]->start, remainders[i]->size);
+        }
+    }
+
+    void clear() {
+        for (uint i = 0; i < v.entries; i++) {
+            pages.remove(at(i)->start, at(i)->size);
+            free_region(at(i));
+        }
+        v.entries = 0;
+    }
+
+    // Calls `f` on the address of every dirty line.
+    template <typename F> void foreach_dirty_line(F f) const {
+        for (uint i = 0; i < v.entries; i++) {
+            const region *r = at(i);
+            for (size_t w = 0, num_words = r->num_words(); w < num_words; w++) {
+                for (uint64_t bits = r->dirty[w]; bits != 0; bits &= bits - 1) {
+                    size_t line = w * BITS_PER_WORD + __builtin_ctzll(bits);
+                    f(r->line_base() + line * LINE_SIZE_B);
+                }
+            }
+        }
+    }
+
+    // Pages overlapping a fresh region.
+    [[nodiscard]] const page_map &fresh_pages() const { return pages; }
+
+  private:
+    drvector_t v; // Of `region *`; sorted by start, disjoint, and not adjacent.
+    page_map pages;
+
+    [[nodiscard]] region *at(uint i) const { return static_cast<region *>(v.array[i]); }
+
+    // Returns the index of the first region whose start is >= `addr`.
+    [[nodiscard]] uint lower_bound(uintptr_t addr) const {
+        uint lo = 0, hi = v.entries;
+        while (lo < hi) {
+            uint mid = lo + (hi - lo) / 2;
+            if (at(mid)->start < addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    // Replaces regions [first, last) with `new_regions`.
+    void splice(uint first, uint last, region *const *new_regions, uint num_new) {
+        uint old_entries = v.entries;
+        uint new_entries = old_entries - (last - first) + num_new;
+        while (v.entries < new_entries) { // Make sure there's enough space.
+            drvector_append(&v, nullptr);
+        }
+        memmove(&v.array[first + num_new], &v.array[last], sizeof(void *) * (old_entries - last));
+        for (uint i = 0; i < num_new; i++) {
+            v.array[first + i] = new_regions[i];
+        }
+        v.entries = new_entries;
+    }
+
+    static void set_bits(uint64_t *bits, size_t first, size_t last) {
+        size_t first_word = first / BITS_PER_WORD, last_word = last / BITS_PER_WORD;
+        uint64_t first_mask = ~0ull << (first % BITS_PER_WORD);
+        uint64_t last_mask = ~0ull >> (BITS_PER_WORD - 1 - last % BITS_PER_WORD);
+        if (first_word == last_word) {
+            bits[first_word] |= first_mask & last_mask;
+            return;
+        }
+        bits[first_word] |= first_mask;
+        for (size_t w = first_word + 1; w < last_word; w++) {
+            bits[w] = ~0ull;
+        }
+        bits[last_word] |= last_mask;
+    }
+
+    // Marks lines in `dst` that are dirty in `src`.  Only the part of `src` that `dst` covers is copied.
+    static void copy_dirty(region *dst, const region *src) {
+        uintptr_t lo = std::max(dst->start, src->start), hi = std::min(dst->end(), src->end());
+        if (lo >= hi) {
+            return;
+        }
+        size_t src_first = (lo - src->line_base()) / LINE_SIZE_B;
+        size_t src_last = (hi - 1 - src->line_base()) / LINE_SIZE_B;
+        for (size_t line = src_first; line <= src_last; line++) {
+            if (src->dirty[line / BITS_PER_WORD] & (1ull << (line % BITS_PER_WORD))) {
+                uintptr_t addr = src->line_base() + line * LINE_SIZE_B;
+                mark_dirty(dst, std::max(addr, lo), 1);
+            }
+        }
+    }
+
+    [[nodiscard]] static region *new_region(uintptr_t start, size_t size) {
+        auto r = new (dr_global_alloc(sizeof(region))) region{start, size, nullptr};
+        size_t bitmap_size = r->num_words() * sizeof(uint64_t);
+        r->dirty = static_cast<uint64_t *>(dr_global_alloc(bitmap_size));
+        memset(r->dirty, 0, bitmap_size);
+        return r;
+    }
+
+    static void free_region(region *r) {
+        dr_global_free(r->dirty, r->num_words() * sizeof(uint64_t));
+        dr_global_free(r, sizeof(region));
+    }
+};
+
+#endif // PSM_SRC_UNDO_FRESH_REGIONS_H
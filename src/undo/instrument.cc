@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <cstdint>
 #include <limits>
 #include <new>
 
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/syscall.h>
 
 #include "dr_api.h"
@@ -12,7 +14,10 @@
 #include "drutil.h"
 #include "drvector.h"
 #include "drwrap.h"
+#include "drx.h"
+#include "hashtable.h"
 
+#include "mem_region/high_water.h"
 #include "mem_region/mem_region.h"
 #include "undo_bg.h"
 
@@ -37,9 +42,188 @@ static bool region_table_modified = false;
 
 static module_data_t *psm_module;
 
+// Each thread's number of `psm_undo_trusted_call` frames on its stack (stored as a pointer-sized integer).
+static int trusted_call_depth_tls_idx = -1;
+
+#if OPTIMIZE_TRACE_BUFFER
+// Writes that miss the inlined fast path are appended to a per-thread trace buffer,
+// which is processed in bulk at the end of each write group (see `event_app_instruction`).
+struct write_record {
+    uintptr_t addr;
+    uint32_t size;
+    uint32_t padding;
+#if INSTRUMENT_LOGGING
+    uintptr_t pc;
+#endif
+};
+// The buffer is emptied after every write group, so it only needs to hold one group's writes;
+// the "full" callback is a safety net.
+constexpr size_t WRITE_BUF_SIZE_B = 4096;
+static drx_buf_t *write_buf;
+// Non-null if the thread's trace buffer might be non-empty.
+static int write_buf_pending_tls_idx = -1;
+#endif
+
+#if OPTIMIZE_SKIP_STACK
+// Each thread's stack is [lo, lo + size), kept in raw TLS slots so that instrumentation can compare against
+// them directly.  Writes to the stack are not undo-logged.
+enum stack_tls_slot { STACK_TLS_LO, STACK_TLS_SIZE, NUM_STACK_TLS_SLOTS };
+static reg_id_t stack_tls_seg;
+static uint stack_tls_offs;
+// The stack TLS slots of every live thread (`uintptr_t *`), so that a thread's mmap or munmap can update them all.
+static drvector_t thread_stacks;
+#endif
+
+#if OPTIMIZE_WRAP_BULK_FUNCS
+// The application's libc implementations, which the `replace_*` functions below call natively.
+static void *(*app_memcpy)(void *, const void *, size_t);
+static void *(*app_memmove)(void *, const void *, size_t);
+static void *(*app_memset)(void *, int, size_t);
+#endif
+
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+// Heap objects allocated since the previous commit: object address -> requested size.
+static hashtable_t fresh_objects;
+// Memory mapped since instrumentation started that the allocator hasn't handed out yet (see `add_fresh_object`).
+static high_water *never_allocated;
+// Each thread's `realloc_call` (see `wrap_realloc_pre`).
+static int realloc_call_tls_idx = -1;
+#endif
+
 // ***** GLOBALS ABOVE *****
 
+#if OPTIMIZE_SKIP_STACK
+// The current thread's stack TLS slots (see `stack_tls_slot`).
+static uintptr_t *thread_stack() {
+    return reinterpret_cast<uintptr_t *>(static_cast<byte *>(dr_get_dr_segment_base(stack_tls_seg)) + stack_tls_offs);
+}
+
+static opnd_t stack_tls_opnd(stack_tls_slot slot) {
+    return opnd_create_far_base_disp(stack_tls_seg, DR_REG_NULL, DR_REG_NULL, 0,
+                                     static_cast<int>(stack_tls_offs + slot * sizeof(void *)), OPSZ_PTR);
+}
+
+// Finds the memory region holding the stack of the thread `drcontext`.
+static bool query_thread_stack(void *drcontext, dr_mem_info_t *info) {
+    dr_mcontext_t mc = {sizeof(mc), DR_MC_CONTROL};
+    if (dr_get_mcontext(drcontext, &mc)) {
+        return dr_query_memory_ex(reinterpret_cast<app_pc>(mc.xsp), info);
+    }
+    // The application state of the initial thread might not be available yet; its stack is the main stack.
+    app_pc pc = nullptr;
+    while (reinterpret_cast<uintptr_t>(pc) < POINTER_MAX && dr_query_memory_ex(pc, info)) {
+        if (info->prot & DR_MEMPROT_STACK) {
+            return true;
+        }
+        pc = info->base_pc + info->size;
+    }
+    return false;
+}
+
+static void event_thread_init(void *drcontext) {
+    dr_mem_info_t info;
+    if (!query_thread_stack(drcontext, &info)) {
+        dr_fprintf(STDERR, "*** WARNING: stack of thread %d not found; stack writes will be recorded\n",
+                   dr_get_thread_id(drcontext));
+        return;
+    }
+    auto lo = reinterpret_cast<uintptr_t>(info.base_pc);
+    const uintptr_t hi = lo + info.size;
+
+    if (info.prot & DR_MEMPROT_STACK) {
+        // The main stack grows on demand, up to RLIMIT_STACK, into the gap below it (which the kernel keeps
+        // clear of other mappings).  Other threads' stacks are fixed-size mappings.
+        struct rlimit rl {};
+        dr_mem_info_t below;
+        if (my_getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < hi &&
+            dr_query_memory_ex(info.base_pc - 1, &below) && below.type == DR_MEMTYPE_FREE) {
+            lo = std::min(lo, std::max(hi - rl.rlim_cur, reinterpret_cast<uintptr_t>(below.base_pc)));
+        }
+    }
+
+    uintptr_t *stack = thread_stack();
+    stack[STACK_TLS_LO] = lo;
+    stack[STACK_TLS_SIZE] = hi - lo;
+    drvector_append(&thread_stacks, stack);
+#if INSTRUMENT_LOGGING
+    dr_fprintf(STDERR, "[bg: event_thread_init] thread %d stack:\t%p-%p\n", dr_get_thread_id(drcontext), lo, hi);
+#endif
+}
+
+static void event_thread_exit_stack(void *drcontext) {
+    uintptr_t *stack = thread_stack();
+    drvector_lock(&thread_stacks);
+    for (uint i = 0; i < thread_stacks.entries; i++) {
+        if (thread_stacks.array[i] == stack) {
+            thread_stacks.array[i] = thread_stacks.array[--thread_stacks.entries];
+            break;
+        }
+    }
+    drvector_unlock(&thread_stacks);
+}
+
+// Takes [start, start + size), which is being mapped or unmapped, out of every thread's stack range.  A stack grows
+// down, so the part of a range above the hole is kept, unless the hole reaches the top of the range.
+static void clip_thread_stacks(uintptr_t start, size_t size) {
+    const uintptr_t end = start + size;
+    drvector_lock(&thread_stacks);
+    for (uint i = 0; i < thread_stacks.entries; i++) {
+        auto *stack = static_cast<uintptr_t *>(thread_stacks.array[i]);
+        const uintptr_t lo = stack[STACK_TLS_LO], hi = lo + stack[STACK_TLS_SIZE];
+        if (start >= hi || end <= lo) {
+            continue;
+        }
+        const uintptr_t new_lo = end < hi ? end : lo;
+        const uintptr_t new_hi = end < hi ? hi : std::max(start, lo);
+        // The thread might be checking against its range right now; emptying the range first means that it never
+        // sees the new `lo` with the old size, which could cover memory past the stack.
+        stack[STACK_TLS_SIZE] = 0;
+        barrier();
+        stack[STACK_TLS_LO] = new_lo;
+        barrier();
+        stack[STACK_TLS_SIZE] = new_hi - new_lo;
+    }
+    drvector_unlock(&thread_stacks);
+}
+
+// Inserts before `where` a check that jumps to `skip_label` if the address in `reg_dst` is on the thread's
+// stack, i.e., `reg_dst - lo < size` (unsigned).  Clobbers `reg_t1` and the arithmetic flags.
+static void insert_stack_check(void *drcontext, instrlist_t *bb, instr_t *where, instr_t *skip_label,
+                               reg_id_t reg_dst, reg_id_t reg_t1) {
+    instrlist_meta_preinsert(bb, where,
+                             INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+    instrlist_meta_preinsert(bb, where,
+                             INSTR_CREATE_sub(drcontext, opnd_create_reg(reg_t1), stack_tls_opnd(STACK_TLS_LO)));
+    instrlist_meta_preinsert(bb, where,
+                             INSTR_CREATE_cmp(drcontext, opnd_create_reg(reg_t1), stack_tls_opnd(STACK_TLS_SIZE)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jb, opnd_create_instr(skip_label)));
+}
+#endif
+
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+static void event_thread_exit_realloc(void *drcontext);
+#endif
+
 static void event_exit() {
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+    hashtable_delete(&fresh_objects);
+    never_allocated->~high_water();
+    dr_global_free(never_allocated, sizeof(*never_allocated));
+    drmgr_unregister_thread_exit_event(event_thread_exit_realloc);
+    drmgr_unregister_tls_field(realloc_call_tls_idx);
+#endif
+#if OPTIMIZE_SKIP_STACK
+    drmgr_unregister_thread_init_event(event_thread_init);
+    drmgr_unregister_thread_exit_event(event_thread_exit_stack);
+    drvector_delete(&thread_stacks);
+    dr_raw_tls_cfree(stack_tls_offs, NUM_STACK_TLS_SLOTS);
+#endif
+#if OPTIMIZE_TRACE_BUFFER
+    drx_buf_free(write_buf);
+    drmgr_unregister_tls_field(write_buf_pending_tls_idx);
+    drx_exit();
+#endif
+    drmgr_unregister_tls_field(trusted_call_depth_tls_idx);
     drwrap_exit();
     drreg_exit();
     drutil_exit();
@@ -53,10 +237,10 @@ static void event_exit() {
 [[gnu::optimize("-O3")]]
 #if INSTRUMENT_LOGGING
 static void
-record_write(uintptr_t addr, uint size, uintptr_t rsp, uintptr_t pc)
+record_write(uintptr_t addr, size_t size, uintptr_t pc)
 #else
 static void
-record_write(uintptr_t addr, uint size, uintptr_t rsp)
+record_write(uintptr_t addr, size_t size)
 #endif
 {
 #if MOCK_OUT_RECORD_WRITE
@@ -64,14 +248,13 @@ record_write(uintptr_t addr, uint size, uintptr_t rsp)
 #endif
 
 #if PRINT_TRACE
-    dr_fprintf(STDERR, "%p,%u\n", addr, size);
+    dr_fprintf(STDERR, "%p,%lu\n", addr, size);
 #endif
 
 #if OPTIMIZE_SKIP_STACK
-    if (unlikely(addr >= rsp - 128)) {
-        // This happens infrequently---most writes to the stack should have been
-        // filtered out because the destination address is an offset from %rsp.
-        // FIXME(zhangwen): the stack can extend below rsp...
+    if (unlikely(addr - thread_stack()[STACK_TLS_LO] < thread_stack()[STACK_TLS_SIZE])) {
+        // This happens infrequently---most writes to the stack are filtered out by
+        // the instrumentation, which does the same check.
         return;
     }
 #endif
@@ -79,11 +262,27 @@ record_write(uintptr_t addr, uint size, uintptr_t rsp)
     DR_ASSERT(!mrm->does_manage(addr));
 #endif
 
+#if OPTIMIZE_LAZY_REPLACE
+    if (unlikely(mrm->is_lazy(addr, size))) {
+        // Until the next commit, the region table on pmem doesn't include the new regions, so recovery
+        // would take their content from the initial checkpoint; no need to undo-log them till then.
+        auto res = mrm->replace_lazy(addr, size, [](app_pc base, size_t size) {
+            ul::undo_log_record_fresh_region(base, size);
+        });
+        DR_ASSERT(res == mem_region_manager::result::SUCCESS);
+        region_table_modified = true;
+    }
+#endif
+
     bool should_commit =
 #if INSTRUMENT_LOGGING
         ul::undo_log_record(addr, size, pc);
 #else
         ul::undo_log_record(addr, size);
+#endif
+#if !OPTIMIZE_BATCH_FENCE
+    // Otherwise, a fence is inserted after the records of a group of writes.
+    pmem_drain();
 #endif
     if (should_commit) {
         // This flag is not flipped until commit time.
@@ -96,6 +295,308 @@ record_write(uintptr_t addr, uint size, uintptr_t rsp)
 #endif
 }
 
+// Records a bulk write to [dst, dst + n) from native code, before it takes place.
+static void record_bulk_write(void *dst, size_t n) {
+    if (n == 0) {
+        return;
+    }
+#if INSTRUMENT_LOGGING
+    record_write(reinterpret_cast<uintptr_t>(dst), n, /* pc */ 0);
+#else
+    record_write(reinterpret_cast<uintptr_t>(dst), n);
+#endif
+    pmem_drain();
+}
+
+// From libpsm/psm.h (whose macros clash with undo_log.h).
+extern "C" int psm_undo_trusted_call(int (*func)(const void *), const void *arg);
+
+static uintptr_t get_trusted_call_depth(void *drcontext) {
+    return reinterpret_cast<uintptr_t>(drmgr_get_tls_field(drcontext, trusted_call_depth_tls_idx));
+}
+
+static void set_trusted_call_depth(void *drcontext, uintptr_t depth) {
+    drmgr_set_tls_field(drcontext, trusted_call_depth_tls_idx, reinterpret_cast<void *>(depth));
+}
+
+// Replaces `psm_undo_trusted_call` through `drwrap_replace_native`: calls `func` natively.
+static int replace_undo_trusted_call(int (*func)(const void *), const void *arg) {
+    void *drcontext = dr_get_current_drcontext();
+    set_trusted_call_depth(drcontext, get_trusted_call_depth(drcontext) + 1);
+    int ret = func(arg);
+    set_trusted_call_depth(drcontext, get_trusted_call_depth(drcontext) - 1);
+    drwrap_replace_native_fini(drcontext);
+    return ret;
+}
+
+// Called by `psm_undo_declare`.  In the background, calls from instrumented code go to `replace_declare_write`
+// instead, so this only runs in the foreground (where DynamoRIO isn't set up, and the TLS field isn't registered),
+// or natively in a trusted call.  The latter is nested in `replace_undo_trusted_call`, so, as in a
+// `drwrap_replace_native` replacement, the thread is known to DynamoRIO and can use its TLS and clean-call-safe
+// functions such as `record_bulk_write`.
+DR_EXPORT void instrument_declare_write(void *addr, size_t len) {
+    if (trusted_call_depth_tls_idx == -1) {
+        return;
+    }
+    void *drcontext = dr_get_current_drcontext();
+    DR_ASSERT_MSG(drcontext != nullptr && get_trusted_call_depth(drcontext) > 0,
+                  "instrument_declare_write called natively outside a trusted call");
+    record_bulk_write(addr, len);
+}
+
+// Replaces `instrument_declare_write` (for calls from instrumented code) through `drwrap_replace_native`.
+// Such writes are instrumented anyway.
+static void replace_declare_write(void *addr, size_t len) { drwrap_replace_native_fini(dr_get_current_drcontext()); }
+
+#if OPTIMIZE_WRAP_BULK_FUNCS
+// These replace the application's libc functions through `drwrap_replace_native`, so that a bulk write is
+// recorded once as a range, and the function body runs natively (i.e., without per-store instrumentation).
+// Calls from PSM itself (whose code isn't instrumented either) aren't recorded.
+static bool called_from_psm(void *ret_addr) {
+    return dr_module_contains_addr(psm_module, static_cast<app_pc>(ret_addr));
+}
+
+static void *replace_memcpy(void *dst, const void *src, size_t n) {
+    if (!called_from_psm(__builtin_return_address(0))) {
+        record_bulk_write(dst, n);
+    }
+    void *ret = app_memcpy(dst, src, n);
+    drwrap_replace_native_fini(dr_get_current_drcontext());
+    return ret;
+}
+
+static void *replace_memmove(void *dst, const void *src, size_t n) {
+    if (!called_from_psm(__builtin_return_address(0))) {
+        record_bulk_write(dst, n);
+    }
+    void *ret = app_memmove(dst, src, n);
+    drwrap_replace_native_fini(dr_get_current_drcontext());
+    return ret;
+}
+
+static void *replace_memset(void *dst, int c, size_t n) {
+    if (!called_from_psm(__builtin_return_address(0))) {
+        record_bulk_write(dst, n);
+    }
+    void *ret = app_memset(dst, c, n);
+    drwrap_replace_native_fini(dr_get_current_drcontext());
+    return ret;
+}
+
+static void replace_bulk_funcs(const module_data_t *info) {
+    // For IFUNC symbols, `dr_get_proc_address` returns the implementation selected by the resolver,
+    // which is what calls (through the PLT) end up at.  Several symbols can resolve to the same implementation
+    // (e.g., glibc's memcpy and memmove), which can only be replaced once; memmove is replaced first, since its
+    // replacement also works for memcpy.
+    app_pc replaced[3];
+    int num_replaced = 0;
+    auto replace = [info, &replaced, &num_replaced](const char *func_name, void *replacement, void **orig) {
+        auto func = reinterpret_cast<app_pc>(dr_get_proc_address(info->handle, func_name));
+        if (func == nullptr) {
+            dr_fprintf(STDERR, "*** WARNING: %s not found in libc\n", func_name);
+            return;
+        }
+        *orig = func;
+        if (std::find(replaced, replaced + num_replaced, func) != replaced + num_replaced) {
+            return;
+        }
+        if (!drwrap_replace_native(func, static_cast<app_pc>(replacement), /* at_entry */ true,
+                                   /* stack_adjust */ 0, /* user_data */ nullptr, /* override */ false)) {
+            DR_ASSERT(false);
+        }
+        replaced[num_replaced++] = func;
+    };
+    replace("memmove", reinterpret_cast<void *>(replace_memmove), reinterpret_cast<void **>(&app_memmove));
+    replace("memcpy", reinterpret_cast<void *>(replace_memcpy), reinterpret_cast<void **>(&app_memcpy));
+    replace("memset", reinterpret_cast<void *>(replace_memset), reinterpret_cast<void **>(&app_memset));
+}
+#endif
+
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+// A rollback restores the allocator's state at the previous commit, so an object's memory can only be fresh if
+// it held none of the allocator's metadata then.  An object reusing memory that was free at the previous commit
+// can't be fresh: free chunks split and coalesce, so their metadata (e.g., glibc's chunk headers and fd/bk links)
+// could be anywhere in it.  Only objects in memory that has never been handed out (since it was mapped) are
+// fresh.  There, an allocator keeps metadata (if any) in front of the objects it will carve out (e.g., glibc's
+// top chunk header), or in their first words (e.g., tcmalloc's free-list links); these bytes, and the next
+// chunk's header, which can overlap the end of an object (e.g., glibc's prev_size), are left out.
+constexpr size_t ALLOC_HEAD_GUARD_B = 32;
+constexpr size_t ALLOC_TAIL_GUARD_B = 16;
+
+static void add_fresh_object(void *ptr, size_t size) {
+    if (ptr == nullptr) {
+        return;
+    }
+    if (!never_allocated->allocate(reinterpret_cast<uintptr_t>(ptr), size) ||
+        size <= ALLOC_HEAD_GUARD_B + ALLOC_TAIL_GUARD_B) {
+        return;
+    }
+    hashtable_add_replace(&fresh_objects, ptr, reinterpret_cast<void *>(size));
+    ul::undo_log_record_fresh_region(static_cast<app_pc>(ptr) + ALLOC_HEAD_GUARD_B,
+                                     size - ALLOC_HEAD_GUARD_B - ALLOC_TAIL_GUARD_B);
+}
+
+// Called before the allocator takes `ptr` back (or resizes it), since it might reuse the object's memory
+// for its own metadata.  Returns whether `ptr` was fresh.
+static bool remove_fresh_object(void *ptr) {
+    if (ptr == nullptr) {
+        return false;
+    }
+    auto size = reinterpret_cast<size_t>(hashtable_lookup(&fresh_objects, ptr));
+    if (size == 0) {
+        return false;
+    }
+    hashtable_remove(&fresh_objects, ptr);
+    ul::undo_log_remove_fresh_region(static_cast<app_pc>(ptr) + ALLOC_HEAD_GUARD_B,
+                                     size - ALLOC_HEAD_GUARD_B - ALLOC_TAIL_GUARD_B);
+    return true;
+}
+
+// `user_data` carries the requested size from the pre- to the post-callback.
+static void wrap_malloc_pre(void *wrapcxt, void **user_data) { *user_data = drwrap_get_arg(wrapcxt, 0); }
+
+static void wrap_calloc_pre(void *wrapcxt, void **user_data) {
+    size_t size;
+    if (__builtin_mul_overflow(reinterpret_cast<size_t>(drwrap_get_arg(wrapcxt, 0)),
+                               reinterpret_cast<size_t>(drwrap_get_arg(wrapcxt, 1)), &size)) {
+        size = 0;
+    }
+    *user_data = reinterpret_cast<void *>(size);
+}
+
+static void wrap_alloc_post(void *wrapcxt, void *user_data) {
+    add_fresh_object(drwrap_get_retval(wrapcxt), reinterpret_cast<size_t>(user_data));
+}
+
+struct realloc_call {
+    void *old_ptr;
+    size_t size;
+};
+
+// The call is kept in TLS, rather than allocated per call, since the post-callback might be skipped (e.g., by a
+// longjmp out of realloc).
+static void wrap_realloc_pre(void *wrapcxt, void **user_data) {
+    void *drcontext = drwrap_get_drcontext(wrapcxt);
+    auto call = static_cast<realloc_call *>(drmgr_get_tls_field(drcontext, realloc_call_tls_idx));
+    if (call == nullptr) {
+        call = static_cast<realloc_call *>(dr_thread_alloc(drcontext, sizeof(realloc_call)));
+        drmgr_set_tls_field(drcontext, realloc_call_tls_idx, call);
+    }
+    call->old_ptr = drwrap_get_arg(wrapcxt, 0);
+    call->size = reinterpret_cast<size_t>(drwrap_get_arg(wrapcxt, 1));
+    remove_fresh_object(call->old_ptr);
+    *user_data = call;
+}
+
+static void wrap_realloc_post(void *wrapcxt, void *user_data) {
+    auto call = static_cast<realloc_call *>(user_data);
+    void *new_ptr = drwrap_get_retval(wrapcxt);
+    // If the object was resized in place, it has been handed out before, so it's not fresh.
+    if (new_ptr != nullptr && new_ptr != call->old_ptr) {
+        add_fresh_object(new_ptr, call->size);
+    }
+}
+
+static void event_thread_exit_realloc(void *drcontext) {
+    if (auto call = drmgr_get_tls_field(drcontext, realloc_call_tls_idx)) {
+        dr_thread_free(drcontext, call, sizeof(realloc_call));
+    }
+}
+
+static void wrap_free_pre(void *wrapcxt, void **user_data) { remove_fresh_object(drwrap_get_arg(wrapcxt, 0)); }
+
+static bool starts_with(const char *s, const char *prefix) {
+    for (; *prefix != '\0'; ++s, ++prefix) {
+        if (*s != *prefix) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_allocator_module(const char *name) {
+    return strcmp(name, "libc.so.6") == 0 || starts_with(name, "libjemalloc.so") || starts_with(name, "libtcmalloc");
+}
+
+static void wrap_allocator(const module_data_t *info) {
+    auto wrap = [info](const char *func_name, void (*pre)(void *, void **), void (*post)(void *, void *)) {
+        auto func = reinterpret_cast<app_pc>(dr_get_proc_address(info->handle, func_name));
+        if (func == nullptr) {
+            return;
+        }
+        if (!drwrap_wrap(func, pre, post)) {
+            DR_ASSERT(false);
+        }
+    };
+    wrap("malloc", wrap_malloc_pre, wrap_alloc_post);
+    wrap("calloc", wrap_calloc_pre, wrap_alloc_post);
+    wrap("realloc", wrap_realloc_pre, wrap_realloc_post);
+    wrap("free", wrap_free_pre, nullptr);
+}
+#endif
+
+#if OPTIMIZE_WRAP_BULK_FUNCS || OPTIMIZE_FRESH_HEAP_OBJECTS
+static void event_module_load(void *drcontext, const module_data_t *info, bool loaded) {
+    const char *name = dr_module_preferred_name(info);
+    if (name == nullptr) {
+        return;
+    }
+#if OPTIMIZE_WRAP_BULK_FUNCS
+    if (strcmp(name, "libc.so.6") == 0) {
+        replace_bulk_funcs(info);
+    }
+#endif
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+    if (is_allocator_module(name)) {
+        wrap_allocator(info);
+    }
+#endif
+}
+#endif
+
+#if OPTIMIZE_TRACE_BUFFER
+// Records the writes in [begin, end): sorts them by address and coalesces overlapping and adjacent
+// writes, so that each block is captured once and the log is filled in address order.
+[[gnu::optimize("-O3")]] static void record_writes(write_record *begin, write_record *end) {
+    if (begin == end) {
+        return;
+    }
+    std::sort(begin, end, [](const write_record &a, const write_record &b) { return a.addr < b.addr; });
+
+    write_record curr = *begin;
+    for (write_record *w = begin + 1; w <= end; w++) {
+        if (w != end && w->addr <= curr.addr + curr.size) {
+            curr.size = std::max<uintptr_t>(curr.size, w->addr + w->size - curr.addr);
+            continue;
+        }
+#if INSTRUMENT_LOGGING
+        record_write(curr.addr, curr.size, curr.pc);
+#else
+        record_write(curr.addr, curr.size);
+#endif
+        if (w != end) {
+            curr = *w;
+        }
+    }
+}
+
+// Clean call inserted at the end of a write group that missed the fast path.
+static void record_buffered_writes() {
+    void *drcontext = dr_get_current_drcontext();
+    auto base = static_cast<write_record *>(drx_buf_get_buffer_base(drcontext, write_buf));
+    auto ptr = static_cast<write_record *>(drx_buf_get_buffer_ptr(drcontext, write_buf));
+    record_writes(base, ptr);
+    drx_buf_set_buffer_ptr(drcontext, write_buf, base);
+    drmgr_set_tls_field(drcontext, write_buf_pending_tls_idx, nullptr);
+}
+
+// Called by drx when the trace buffer is full, which is before any of the buffered writes takes place.
+static void write_buf_full(void *drcontext, void *buf_base, size_t size) {
+    auto base = static_cast<write_record *>(buf_base);
+    record_writes(base, base + size / sizeof(write_record));
+}
+#endif
+
 // Called through `drwrap_replace_native`.
 // I just copied the implementation of `dr_fprintf`.
 DR_EXPORT void instrument_log(const char *fmt, ...) {
@@ -128,6 +629,13 @@ DR_EXPORT void instrument_commit(int tail) {
 
 #if !MOCK_OUT_RECORD_WRITE
     assert_not_instrumented();
+#if OPTIMIZE_TRACE_BUFFER
+    {
+        // Buffered writes are recorded before the end of their write group.
+        void *drcontext = dr_get_current_drcontext();
+        DR_ASSERT(drx_buf_get_buffer_ptr(drcontext, write_buf) == drx_buf_get_buffer_base(drcontext, write_buf));
+    }
+#endif
     if (region_table_modified) {
         mrm->persist_new_region_table();
     }
@@ -144,13 +652,80 @@ DR_EXPORT void instrument_cleanup() {
         mrm->commit_new_region_table();
     }
     ul::undo_log_post_commit_cleanup();
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+    // Fresh regions have just been cleared.
+    hashtable_clear(&fresh_objects);
+#endif
+    if (region_table_modified) {
+        ul::undo_log_reset_regions(mrm);
+    }
     region_table_modified = false;
 #endif
     drwrap_replace_native_fini(dr_get_current_drcontext());
 }
 
+#if OPTIMIZE_REP_STRING_RANGE
+static bool is_rep_stos_or_movs(instr_t *instr) {
+    int opcode = instr_get_opcode(instr);
+    return opcode == OP_rep_stos || opcode == OP_rep_movs;
+}
+
+// Clean call inserted before a `rep stos` or `rep movs`, which records the entire destination range.
+static void record_rep_string(uint elem_size) {
+    void *drcontext = dr_get_current_drcontext();
+    dr_mcontext_t mc = {sizeof(mc), DR_MC_INTEGER | DR_MC_CONTROL};
+    if (!dr_get_mcontext(drcontext, &mc)) {
+        DR_ASSERT(false);
+    }
+    if (mc.xcx == 0) {
+        return;
+    }
+    size_t size = mc.xcx * elem_size;
+    // With the direction flag set, the instruction writes downward, starting at %rdi.
+    uintptr_t addr = (mc.xflags & EFLAGS_DF) ? mc.xdi + elem_size - size : mc.xdi;
+#if INSTRUMENT_LOGGING
+    record_write(addr, size, reinterpret_cast<uintptr_t>(mc.pc));
+#else
+    record_write(addr, size);
+#endif
+}
+
+// Inserts a clean call before `instr` (a `rep stos` or `rep movs`) that records its destination.
+static void insert_rep_string_instrumentation(void *drcontext, instrlist_t *bb, instr_t *instr) {
+    opnd_t dst = instr_get_dst(instr, 0);
+    DR_ASSERT(opnd_is_memory_reference(dst));
+    uint elem_size = opnd_size_in_bytes(opnd_get_size(dst));
+    dr_insert_clean_call(drcontext, bb, instr, reinterpret_cast<void *>(record_rep_string),
+                         /* save fp state */ false, /* num_args */ 1, OPND_CREATE_INT32(elem_size));
+}
+#endif
+
 static dr_emit_flags_t event_bb_app2app(void *drcontext, void *tag, instrlist_t *bb, bool for_trace,
                                         bool translating) {
+#if OPTIMIZE_REP_STRING_RANGE
+    // `rep stos` and `rep movs` run natively; their destination is recorded as a whole beforehand.  Other rep
+    // string instructions are expanded below, which drutil only does for one per block.  So the block is cut
+    // short before its second rep string instruction (if any), which then starts a block of its own.
+    instr_t *rep_string = nullptr;
+    for (instr_t *instr = instrlist_first_app(bb); instr != nullptr; instr = instr_get_next_app(instr)) {
+        if (!instr_is_rep_string_op(instr)) {
+            continue;
+        }
+        if (rep_string == nullptr) {
+            rep_string = instr;
+            continue;
+        }
+        for (instr_t *next; instr != nullptr; instr = next) {
+            next = instr_get_next(instr);
+            instrlist_remove(bb, instr);
+            instr_destroy(drcontext, instr);
+        }
+        break;
+    }
+    if (rep_string != nullptr && is_rep_stos_or_movs(rep_string)) {
+        return DR_EMIT_DEFAULT;
+    }
+#endif
     /* Transform string loops into regular loops to monitor all memory accesses. */
     if (!drutil_expand_rep_string(drcontext, bb)) {
         DR_ASSERT(false);
@@ -158,110 +733,373 @@ static dr_emit_flags_t event_bb_app2app(void *drcontext, void *tag, instrlist_t
     return DR_EMIT_DEFAULT;
 }
 
-#if OPTIMIZE_SKIP_RECORD
-static void insert_instrumentation(void *drcontext, instrlist_t *bb, instr_t *instr, opnd_t opnd) {
-    uint size = drutil_opnd_mem_size_in_bytes(opnd, instr);
-    DR_ASSERT(size > 0);
+// Inserts instrumentation before `where` that records a write by `instr` of `size` bytes to `opnd`.
+// Unless `where` is `instr`, none of the registers `opnd` uses may be modified
+// between `where` and `instr` (see `event_bb_analysis`).
+static void insert_instrumentation(void *drcontext, instrlist_t *bb, instr_t *where, instr_t *instr, opnd_t opnd,
+                                   uint size) {
 #if INSTRUMENT_LOGGING
     app_pc pc = instr_get_app_pc(instr);
 #endif
+    DR_ASSERT(size > 0);
 
-    instr_t *slow_path_label = INSTR_CREATE_label(drcontext);
-    instr_t *skip_label = INSTR_CREATE_label(drcontext);
-
-    /* FIXME(zhangwen): I remember there was a bug here that prevented correct restoration of a
-     * reserved register.  I think the bug only manifested itself on a basic block that used _lots_
-     * of registers (an unused register doesn't need to be restored), e.g., on a basic block that
-     * represents an unrolled loop body.  I haven't looked into it too much, but a fix would probably
-     * involve adding instrumentation in separate passes in DynamoRIO.  This bug doesn't seem to affect
-     * the real-life applications evaluated in the paper (Redis, TAPIR). */
+    // drreg restores a register it has spilled lazily, i.e., before the next _application_ instruction
+    // that reads it.  A register reserved for a previous write in the group might still hold our value,
+    // so restore the application values of the registers `opnd` uses, and keep them from being reserved.
+    drvector_t allowed;
+    if (drreg_init_and_fill_vector(&allowed, true) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+    }
+    for (reg_id_t reg = DR_REG_START_GPR; reg <= DR_REG_STOP_GPR; reg++) {
+        if (opnd_uses_reg(opnd, reg)) {
+            if (drreg_set_vector_entry(&allowed, reg, false) != DRREG_SUCCESS ||
+                drreg_get_app_value(drcontext, bb, where, reg, reg) != DRREG_SUCCESS) {
+                DR_ASSERT(false);
+            }
+        }
+    }
 
-    /* `reg_dst` always holds the destination address of the write; do not
-     * clobber, as the clean call uses it as an argument. */
+    /* `reg_dst` always holds the destination address of the write on the slow
+     * path; do not clobber, as the clean call uses it as an argument. */
     reg_id_t reg_dst, reg_t1;
-    if (drreg_reserve_register(drcontext, bb, instr, nullptr, &reg_dst) != DRREG_SUCCESS ||
-        drreg_reserve_register(drcontext, bb, instr, nullptr, &reg_t1) != DRREG_SUCCESS) {
+    if (drreg_reserve_register(drcontext, bb, where, &allowed, &reg_dst) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, bb, where, &allowed, &reg_t1) != DRREG_SUCCESS) {
+        DR_ASSERT_MSG(false, "failed to reserve registers");
+    }
+#if OPTIMIZE_SKIP_RECORD || OPTIMIZE_TRACE_BUFFER
+    reg_id_t reg_t2;
+    if (drreg_reserve_register(drcontext, bb, where, &allowed, &reg_t2) != DRREG_SUCCESS) {
         DR_ASSERT_MSG(false, "failed to reserve registers");
     }
+#endif
+    drvector_delete(&allowed);
+
     /* The `drutil_insert_get_mem_addr` call must come before
      * `drreg_reserve_aflags`, which can clobber %eax. */
-    if (bool ok = drutil_insert_get_mem_addr(drcontext, bb, instr, opnd, reg_dst, reg_t1); !ok) {
+    if (bool ok = drutil_insert_get_mem_addr(drcontext, bb, where, opnd, reg_dst, reg_t1); !ok) {
         DR_ASSERT_MSG(false, "failed to insert get mem addr");
     }
-    if (drreg_reserve_aflags(drcontext, bb, instr) != DRREG_SUCCESS) {
+
+#if OPTIMIZE_SKIP_RECORD || OPTIMIZE_SKIP_STACK
+    if (drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS) {
         DR_ASSERT_MSG(false, "failed to reserve aflags");
     }
-    ul::undo_insert_fast_path(drcontext, bb, instr, size, slow_path_label, skip_label, reg_dst, reg_t1);
+    instr_t *skip_label = INSTR_CREATE_label(drcontext);
+#endif
+#if OPTIMIZE_SKIP_STACK
+    insert_stack_check(drcontext, bb, where, skip_label, reg_dst, reg_t1);
+#endif
+#if OPTIMIZE_SKIP_RECORD
+    instr_t *slow_path_label = INSTR_CREATE_label(drcontext);
+    ul::undo_insert_fast_path(drcontext, bb, where, size, slow_path_label, skip_label, reg_dst, reg_t1, reg_t2);
 
     /* The slow path. */
-    instrlist_meta_preinsert(bb, instr, slow_path_label);
+    instrlist_meta_preinsert(bb, where, slow_path_label);
+#endif
+
+#if OPTIMIZE_TRACE_BUFFER
+    // Append the write to the trace buffer, and mark the buffer as pending.
+    drx_buf_insert_load_buf_ptr(drcontext, write_buf, bb, where, reg_t1);
+    if (!drx_buf_insert_buf_store(drcontext, write_buf, bb, where, reg_t1, reg_t2, opnd_create_reg(reg_dst), OPSZ_8,
+                                  offsetof(write_record, addr)) ||
+        !drx_buf_insert_buf_store(drcontext, write_buf, bb, where, reg_t1, reg_t2, OPND_CREATE_INT32(size), OPSZ_4,
+                                  offsetof(write_record, size))) {
+        DR_ASSERT_MSG(false, "failed to insert trace buffer store");
+    }
 #if INSTRUMENT_LOGGING
-    dr_insert_clean_call(drcontext, bb, instr, reinterpret_cast<void *>(record_write),
-                         /* save fp state */ false, /* num_args */ 4, opnd_create_reg(reg_dst),
-                         OPND_CREATE_INT32(size), opnd_create_reg(DR_REG_RSP), OPND_CREATE_INTPTR(pc));
+    if (!drx_buf_insert_buf_store(drcontext, write_buf, bb, where, reg_t1, reg_t2,
+                                  OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(pc)), OPSZ_8,
+                                  offsetof(write_record, pc))) {
+        DR_ASSERT_MSG(false, "failed to insert trace buffer store");
+    }
+#endif
+    drx_buf_insert_update_buf_ptr(drcontext, write_buf, bb, where, reg_t1, reg_t2, sizeof(write_record));
+    instrlist_meta_preinsert(bb, where,
+                             INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT32(1)));
+    if (!drmgr_insert_write_tls_field(drcontext, write_buf_pending_tls_idx, bb, where, reg_t1, reg_t2)) {
+        DR_ASSERT_MSG(false, "failed to insert TLS write");
+    }
 #else
-    dr_insert_clean_call(drcontext, bb, instr, reinterpret_cast<void *>(record_write),
+    // `reinterpret_cast` can convert a function pointer to `void *` on a
+    // POSIX-compatible system.
+#if INSTRUMENT_LOGGING
+    dr_insert_clean_call(drcontext, bb, where, reinterpret_cast<void *>(record_write),
                          /* save fp state */ false, /* num_args */ 3, opnd_create_reg(reg_dst),
-                         OPND_CREATE_INT32(size), opnd_create_reg(DR_REG_RSP));
+                         OPND_CREATE_INT32(size), OPND_CREATE_INTPTR(pc));
+#else
+    dr_insert_clean_call(drcontext, bb, where, reinterpret_cast<void *>(record_write),
+                         /* save fp state */ false, /* num_args */ 2, opnd_create_reg(reg_dst),
+                         OPND_CREATE_INT32(size));
+#endif
 #endif
 
-    /* The fast path jumps here. */
-    instrlist_meta_preinsert(bb, instr, skip_label);
-    if (drreg_unreserve_aflags(drcontext, bb, instr) != DRREG_SUCCESS) {
+#if OPTIMIZE_SKIP_RECORD || OPTIMIZE_SKIP_STACK
+    /* The fast path and the stack check jump here. */
+    instrlist_meta_preinsert(bb, where, skip_label);
+    if (drreg_unreserve_aflags(drcontext, bb, where) != DRREG_SUCCESS) {
         DR_ASSERT_MSG(false, "failed to unreserve aflags");
     }
-    if (drreg_unreserve_register(drcontext, bb, instr, reg_t1) != DRREG_SUCCESS ||
-        drreg_unreserve_register(drcontext, bb, instr, reg_dst) != DRREG_SUCCESS) {
+#endif
+#if OPTIMIZE_SKIP_RECORD || OPTIMIZE_TRACE_BUFFER
+    if (drreg_unreserve_register(drcontext, bb, where, reg_t2) != DRREG_SUCCESS) {
+        DR_ASSERT_MSG(false, "failed to unreserve registers");
+    }
+#endif
+    if (drreg_unreserve_register(drcontext, bb, where, reg_t1) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, where, reg_dst) != DRREG_SUCCESS) {
         DR_ASSERT_MSG(false, "failed to unreserve registers");
     }
 }
-#else
-static void insert_instrumentation(void *drcontext, instrlist_t *bb, instr_t *instr, opnd_t opnd) {
-#if INSTRUMENT_LOGGING
-    app_pc pc = instr_get_app_pc(instr);
+
+// Returns whether a write to `opnd` should be undo-logged.
+static bool should_record(opnd_t opnd) {
+    if (!opnd_is_memory_reference(opnd)) {
+        return false;
+    }
+#if OPTIMIZE_SKIP_STACK
+    if (opnd_is_base_disp(opnd) && opnd_get_base(opnd) == DR_REG_XSP) {
+        // Assume that this write destination is on the stack.  Ignore!
+        // TODO(zhangwen): is this assumption reasonable?
+        return false;
+    }
 #endif
+    return true;
+}
 
-    reg_id_t reg_dst, reg_tmp = DR_REG_NULL;
-    if (drreg_reserve_register(drcontext, bb, instr, nullptr, &reg_dst) != DRREG_SUCCESS) {
-        DR_ASSERT(false);
+#if OPTIMIZE_BATCH_FENCE
+// At most this many records share a persistence fence.
+constexpr int BATCH_FENCE_MAX_WRITES = 16;
+// Writes in a group that differ only in displacement are recorded together if they span at most this many bytes.
+constexpr int MAX_COALESCED_SPAN_B = 256;
+#if OPTIMIZE_SKIP_RECORD
+// Such records are still checked inline (rather than always taking the slow path).
+static_assert(MAX_COALESCED_SPAN_B <= ul::FAST_PATH_MAX_PROBED_B, "coalesced records too large for the fast path");
+#endif
+
+// Writes in a basic block whose records are all inserted before the first write in the group
+// (the "head"), followed by a single fence.  This works because none of the registers used to
+// address a write is modified between the head and the write, so the address can be computed at
+// the head; and logging a block earlier than necessary is harmless.
+struct write_group {
+    instr_t *head;
+    int num_writes;
+    struct {
+        instr_t *instr; // The first write covered by this record.
+        opnd_t opnd;
+        uint size;
+    } writes[BATCH_FENCE_MAX_WRITES];
+    // If true, the group consists of just `head`, which is a `rep stos` or `rep movs`.
+    bool rep_string;
+};
+
+// Passed from the analysis event to the insertion event of a basic block.
+struct bb_write_groups {
+    drvector_t groups; // of `write_group *`, in program order.
+    uint next;         // Index of the next group to instrument.
+};
+
+static void free_write_group(void *group) { dr_global_free(group, sizeof(write_group)); }
+
+// Returns whether the address of a write to `opnd` can be computed before the
+// group head, given that the registers in `written_regs` have been modified since.
+static bool can_hoist(opnd_t opnd, uint written_regs) {
+    if (!opnd_is_base_disp(opnd) && !opnd_is_abs_addr(opnd) && !opnd_is_rel_addr(opnd)) {
+        return false;
+    }
+    if (opnd_get_segment(opnd) != DR_REG_NULL) {
+        return false;
+    }
+    for (reg_id_t reg = DR_REG_START_GPR; reg <= DR_REG_STOP_GPR; reg++) {
+        if ((written_regs & (1u << (reg - DR_REG_START_GPR))) && opnd_uses_reg(opnd, reg)) {
+            return false;
+        }
     }
-    DR_ASSERT(reg_dst != DR_REG_NULL);
+    return true;
+}
 
-    // If I understand it correctly, `drutil_insert_get_mem_addr()` does not
-    // clobber the eflags since it only inserts LEA and MOV instructions.
-    bool ok = drutil_insert_get_mem_addr(drcontext, bb, instr, opnd, reg_dst, DR_REG_NULL);
-    if (!ok) {
-        // Try again with a temporary register.
-        if (drreg_reserve_register(drcontext, bb, instr, nullptr, &reg_tmp) != DRREG_SUCCESS) {
-            DR_ASSERT(false);
+// Tries to extend a record in `group` to also cover a write of `size` bytes to `opnd`,
+// e.g., `[rbx+8]` after `[rbx]`.  The write must be hoistable to the group head.
+static bool coalesce_write(write_group *group, opnd_t opnd, uint size) {
+    if (!opnd_is_base_disp(opnd)) {
+        return false;
+    }
+    const int disp = opnd_get_disp(opnd);
+    for (int i = 0; i < group->num_writes; i++) {
+        auto &w = group->writes[i];
+        if (!opnd_is_base_disp(w.opnd) || opnd_get_base(w.opnd) != opnd_get_base(opnd) ||
+            opnd_get_index(w.opnd) != opnd_get_index(opnd) || opnd_get_scale(w.opnd) != opnd_get_scale(opnd) ||
+            opnd_get_segment(w.opnd) != opnd_get_segment(opnd)) {
+            continue;
         }
-        DR_ASSERT(reg_tmp != DR_REG_NULL);
-        ok = drutil_insert_get_mem_addr(drcontext, bb, instr, opnd, reg_dst, reg_tmp);
+        const int w_disp = opnd_get_disp(w.opnd);
+        const int64_t lo = std::min(w_disp, disp);
+        const int64_t hi = std::max<int64_t>(int64_t{w_disp} + w.size, int64_t{disp} + size);
+        if (hi - lo > MAX_COALESCED_SPAN_B) {
+            continue;
+        }
+        // Any gap between the writes gets logged too, which is harmless.
+        opnd_set_disp(&w.opnd, static_cast<int>(lo));
+        w.size = static_cast<uint>(hi - lo);
+        return true;
     }
-    DR_ASSERT(ok);
+    return false;
+}
 
-    uint size = drutil_opnd_mem_size_in_bytes(opnd, instr);
-    DR_ASSERT(size > 0);
+// Splits the writes in a basic block into groups.
+static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace,
+                                         bool translating, void **user_data) {
+    auto *bb_groups = static_cast<bb_write_groups *>(dr_thread_alloc(drcontext, sizeof(bb_write_groups)));
+    if (!drvector_init(&bb_groups->groups, /* initial capacity */ 4, false, free_write_group)) {
+        DR_ASSERT(false);
+    }
+    bb_groups->next = 0;
+    *user_data = bb_groups;
 
-    // `reinterpret_cast` can convert a function pointer to `void *` on a
-    // POSIX-compatible system.
-#if INSTRUMENT_LOGGING
-    dr_insert_clean_call(drcontext, bb, instr, reinterpret_cast<void *>(record_write),
-                         /* save fp state */ false, /* num_args */ 4, opnd_create_reg(reg_dst),
-                         OPND_CREATE_INT32(size), opnd_create_reg(DR_REG_RSP), OPND_CREATE_INTPTR(pc));
-#else
-    dr_insert_clean_call(drcontext, bb, instr, reinterpret_cast<void *>(record_write),
-                         /* save fp state */ false, /* num_args */ 3, opnd_create_reg(reg_dst),
-                         OPND_CREATE_INT32(size), opnd_create_reg(DR_REG_RSP));
-#endif
+    instr_t *first = instrlist_first_app(bb);
+    if (first == nullptr || dr_module_contains_addr(psm_module, instr_get_app_pc(first))) {
+        // This basic block is from PSM code (not application code). Ignore!
+        return DR_EMIT_DEFAULT;
+    }
 
-    if (drreg_unreserve_register(drcontext, bb, instr, reg_dst) != DRREG_SUCCESS ||
-        (reg_tmp != DR_REG_NULL && drreg_unreserve_register(drcontext, bb, instr, reg_tmp) != DRREG_SUCCESS)) {
+#if OPTIMIZE_SKIP_RECORD
+    // The inlined fast path branches around the clean call while registers are reserved.  Have drreg
+    // restore registers eagerly at unreserve (rather than lazily) so that both paths see the same state,
+    // even in basic blocks where drreg has to spill live registers.
+    if (drreg_set_bb_properties(drcontext, DRREG_CONTAINS_SPANNING_CONTROL_FLOW) != DRREG_SUCCESS) {
         DR_ASSERT(false);
     }
+#endif
+
+    write_group *curr = nullptr;
+    uint written_regs = 0; // Bit `reg - DR_REG_START_GPR` is set if `reg` was modified since `curr->head`.
+    for (instr_t *instr = first; instr != nullptr; instr = instr_get_next_app(instr)) {
+#if ENABLE_ASSERT_NOT_INSTRUMENTED
+        int opcode = instr_get_opcode(instr);
+        DR_ASSERT_MSG(opcode != OP_cpuid, "CPUID encountered -- assert_not_instrumented failed?");
+#endif
+
+#if OPTIMIZE_REP_STRING_RANGE
+        if (is_rep_stos_or_movs(instr)) {
+            curr = new (dr_global_alloc(sizeof(write_group))) write_group{instr, 0, {}, /* rep_string */ true};
+            drvector_append(&bb_groups->groups, curr);
+            curr = nullptr; // The instruction modifies %rdi and %rcx.
+            continue;
+        }
+#endif
+        if (instr_writes_memory(instr)) {
+            for (int i = 0; i < instr_num_dsts(instr); i++) {
+                opnd_t opnd = instr_get_dst(instr, i);
+                if (!should_record(opnd)) {
+                    continue;
+                }
+                uint size = drutil_opnd_mem_size_in_bytes(opnd, instr);
+                if (curr != nullptr && can_hoist(opnd, written_regs)) {
+                    if (coalesce_write(curr, opnd, size)) {
+                        continue;
+                    }
+                    if (curr->num_writes < BATCH_FENCE_MAX_WRITES) {
+                        curr->writes[curr->num_writes++] = {instr, opnd, size};
+                        continue;
+                    }
+                }
+                curr = new (dr_global_alloc(sizeof(write_group))) write_group{instr, 0, {}};
+                drvector_append(&bb_groups->groups, curr);
+                written_regs = 0;
+                curr->writes[curr->num_writes++] = {instr, opnd, size};
+            }
+        }
+
+        if (curr == nullptr) {
+            continue;
+        }
+        if (instr_is_cti(instr) || instr_is_syscall(instr) || instr_is_interrupt(instr)) {
+            // Don't hoist records across control flow (e.g., the loop that `drutil_expand_rep_string`
+            // creates) or system calls (e.g., `munmap`).
+            curr = nullptr;
+            continue;
+        }
+        for (reg_id_t reg = DR_REG_START_GPR; reg <= DR_REG_STOP_GPR; reg++) {
+            if (instr_writes_to_reg(instr, reg, DR_QUERY_INCLUDE_ALL)) {
+                written_regs |= 1u << (reg - DR_REG_START_GPR);
+            }
+        }
+    }
+    return DR_EMIT_DEFAULT;
 }
+
+#if OPTIMIZE_TRACE_BUFFER
+// Inserts before `where` a clean call that records the buffered writes, if any.
+static void insert_record_buffered_writes(void *drcontext, instrlist_t *bb, instr_t *where) {
+    reg_id_t reg;
+    if (drreg_reserve_register(drcontext, bb, where, nullptr, &reg) != DRREG_SUCCESS ||
+        drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS) {
+        DR_ASSERT_MSG(false, "failed to reserve");
+    }
+    instr_t *done_label = INSTR_CREATE_label(drcontext);
+    if (!drmgr_insert_read_tls_field(drcontext, write_buf_pending_tls_idx, bb, where, reg)) {
+        DR_ASSERT_MSG(false, "failed to insert TLS read");
+    }
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_test(drcontext, opnd_create_reg(reg), opnd_create_reg(reg)));
+    instrlist_meta_preinsert(bb, where, INSTR_CREATE_jcc(drcontext, OP_jz, opnd_create_instr(done_label)));
+    dr_insert_clean_call(drcontext, bb, where, reinterpret_cast<void *>(record_buffered_writes),
+                         /* save fp state */ false, /* num_args */ 0);
+    instrlist_meta_preinsert(bb, where, done_label);
+    if (drreg_unreserve_aflags(drcontext, bb, where) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, where, reg) != DRREG_SUCCESS) {
+        DR_ASSERT_MSG(false, "failed to unreserve");
+    }
+}
+#endif
+
+static void insert_group_fence(void *drcontext, instrlist_t *bb, instr_t *where) {
+    reg_id_t reg;
+    if (drreg_reserve_register(drcontext, bb, where, nullptr, &reg) != DRREG_SUCCESS ||
+        drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS) {
+        DR_ASSERT_MSG(false, "failed to reserve");
+    }
+    ul::undo_insert_group_fence(drcontext, bb, where, reg);
+    if (drreg_unreserve_aflags(drcontext, bb, where) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, where, reg) != DRREG_SUCCESS) {
+        DR_ASSERT_MSG(false, "failed to unreserve");
+    }
+}
+
+static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+                                             bool for_trace, bool translating, void *user_data) {
+    auto *bb_groups = static_cast<bb_write_groups *>(user_data);
+    if (bb_groups->next < bb_groups->groups.entries) {
+        auto *group = static_cast<write_group *>(bb_groups->groups.array[bb_groups->next]);
+        if (group->head == instr) {
+#if OPTIMIZE_REP_STRING_RANGE
+            if (group->rep_string) {
+                insert_rep_string_instrumentation(drcontext, bb, instr);
+            }
 #endif
+            for (int i = 0; i < group->num_writes; i++) {
+                const auto &w = group->writes[i];
+                insert_instrumentation(drcontext, bb, instr, w.instr, w.opnd, w.size);
+            }
+#if OPTIMIZE_TRACE_BUFFER
+            insert_record_buffered_writes(drcontext, bb, instr);
+#endif
+            // A single fence persists the records before any write in the group takes place.
+            insert_group_fence(drcontext, bb, instr);
+            bb_groups->next++;
+        }
+    }
 
+    if (drmgr_is_last_instr(drcontext, instr)) {
+#if PRINT_GENERATED_CODE
+        if (bb_groups->groups.entries > 0)
+            instrlist_disassemble(drcontext, (app_pc)tag, bb, STDERR);
+#endif
+        DR_ASSERT(bb_groups->next == bb_groups->groups.entries);
+        drvector_delete(&bb_groups->groups);
+        dr_thread_free(drcontext, bb_groups, sizeof(bb_write_groups));
+    }
+    return DR_EMIT_DEFAULT;
+}
+#else
 static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
                                              bool for_trace, bool translating, void *user_data) {
     // Start by ignoring instructions that are not subject to instrumentation.
@@ -285,21 +1123,21 @@ static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrli
     if (!instr_writes_memory(instr))
         return DR_EMIT_DEFAULT;
 
+#if OPTIMIZE_REP_STRING_RANGE
+    if (is_rep_stos_or_movs(instr)) {
+        insert_rep_string_instrumentation(drcontext, bb, instr);
+        return DR_EMIT_DEFAULT;
+    }
+#endif
+
         /* insert code to add an entry for each memory reference opnd */
 #if PRINT_GENERATED_CODE
     bool inserted = false;
 #endif
     for (int i = 0; i < instr_num_dsts(instr); i++) {
         opnd_t opnd = instr_get_dst(instr, i);
-        if (opnd_is_memory_reference(opnd)) {
-#if OPTIMIZE_SKIP_STACK
-            if (opnd_is_base_disp(opnd) && opnd_get_base(opnd) == DR_REG_XSP) {
-                // Assume that this write destination is on the stack.  Ignore!
-                // TODO(zhangwen): is this assumption reasonable?
-                continue;
-            }
-#endif
-            insert_instrumentation(drcontext, bb, instr, opnd);
+        if (should_record(opnd)) {
+            insert_instrumentation(drcontext, bb, instr, instr, opnd, drutil_opnd_mem_size_in_bytes(opnd, instr));
 #if PRINT_GENERATED_CODE
             inserted = true;
 #endif
@@ -313,6 +1151,7 @@ static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrli
 
     return DR_EMIT_DEFAULT;
 }
+#endif
 
 static bool event_filter_syscall(void *drcontext, int sysnum) {
     if (sysnum == SYS_mmap || sysnum == SYS_munmap) {
@@ -338,6 +1177,13 @@ static bool event_pre_syscall(void *drcontext, int sysnum) {
         dr_fprintf(STDERR, "munmap:\t%p\t%lu\n", addr, size);
 #endif
         ul::undo_log_remove_fresh_region(addr, size);
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+        never_allocated->remove_mapping(reinterpret_cast<uintptr_t>(addr), size);
+#endif
+#if OPTIMIZE_SKIP_STACK
+        // Memory mapped here later mustn't be mistaken for a stack.
+        clip_thread_stacks(reinterpret_cast<uintptr_t>(addr), size);
+#endif
         auto res = mrm->remove_region(addr, size);
         if (res == mem_region_manager::result::NOT_MANAGED) { // We don't care about this munmap call.
             return true;
@@ -382,8 +1228,16 @@ static void event_post_syscall(void *drcontext, int sysnum) {
 #if INSTRUMENT_LOGGING
             dr_fprintf(STDERR, "mmap:\t%p\t%lu\n", mmap_ret, size);
 #endif
-            auto res = mrm->replace_region(mmap_ret, size, PROT_READ | PROT_WRITE);
+            auto res = mrm->replace_region(mmap_ret, size, PROT_READ | PROT_WRITE, /* is_zero */ true);
             ul::undo_log_record_fresh_region(mmap_ret, size);
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+            never_allocated->add_mapping(reinterpret_cast<uintptr_t>(mmap_ret), size);
+#endif
+#if OPTIMIZE_SKIP_STACK
+            // If the region landed in the gap the main stack might grow into, shrink the stack range (of whichever
+            // thread owns it) so that writes to the region aren't mistaken for stack writes.
+            clip_thread_stacks(reinterpret_cast<uintptr_t>(mmap_ret), size);
+#endif
             DR_ASSERT(res == mem_region_manager::result::SUCCESS);
             region_table_modified = true;
         }
@@ -464,6 +1318,42 @@ static bool should_replace(const dr_mem_info_t *info) {
     return true;
 }
 
+// Calls `f(start, size)` on the parts of [base, base + size) that aren't volatile (see `psm_volatile_region`).
+template <typename F> static void foreach_non_volatile(app_pc base, size_t size, F f) {
+    struct range {
+        uintptr_t start, end;
+    } volatile_pages[MAX_VOLATILE_REGIONS];
+    int n = 0;
+    const uintptr_t page_size = dr_page_size();
+    const auto lo = reinterpret_cast<uintptr_t>(base), hi = lo + size;
+    for (int i = 0; i < instrument_args.num_volatile_regions; i++) {
+        auto start = reinterpret_cast<uintptr_t>(instrument_args.volatile_regions[i].addr);
+        uintptr_t end = start + instrument_args.volatile_regions[i].len;
+        // Only whole pages are volatile.
+        start = std::max(lo, (start + page_size - 1) & ~(page_size - 1));
+        end = std::min(hi, end & ~(page_size - 1));
+        if (start < end) {
+            volatile_pages[n++] = {start, end};
+        }
+    }
+    std::sort(volatile_pages, volatile_pages + n, [](const range &a, const range &b) { return a.start < b.start; });
+
+    uintptr_t curr = lo;
+    for (int i = 0; i <= n; i++) {
+        uintptr_t next = i < n ? volatile_pages[i].start : hi;
+        if (curr < next) {
+            f(reinterpret_cast<app_pc>(curr), next - curr);
+        }
+        if (i < n) {
+#if INSTRUMENT_LOGGING
+            dr_fprintf(STDERR, "[init_address_space] skipping volatile memory:\t%p-%p\n", volatile_pages[i].start,
+                       volatile_pages[i].end);
+#endif
+            curr = std::max(curr, volatile_pages[i].end);
+        }
+    }
+}
+
 static void init_address_space() {
     drvector_t to_replace; // Vector (of `dr_mem_info_t *`) of memory regions to replace.
     // For peace of mind, we avoid replacing memory regions while iterating through them.
@@ -487,21 +1377,17 @@ static void init_address_space() {
     // Now iterate through the memory regions to replace, and replace them.
     for (uint i = 0; i < to_replace.entries; i++) {
         auto infop = static_cast<dr_mem_info_t *>(to_replace.array[i]);
-
-        uint dr_prot = infop->prot;
-        int prot = 0;
-        if (dr_prot & DR_MEMPROT_READ) {
-            prot |= PROT_READ;
-        }
-        if (dr_prot & DR_MEMPROT_WRITE) {
-            prot |= PROT_WRITE;
-        }
-        if (dr_prot & DR_MEMPROT_EXEC) {
-            prot |= PROT_EXEC;
-        }
-
-        auto res = mrm->replace_region(infop->base_pc, infop->size, prot);
-        DR_ASSERT(res == mem_region_manager::result::SUCCESS);
+        int prot = to_mmap_prot(infop->prot);
+        foreach_non_volatile(infop->base_pc, infop->size, [prot](app_pc start, size_t size) {
+#if OPTIMIZE_LAZY_REPLACE
+            // Replaced on first write (see `record_write`).
+            (void)prot;
+            mrm->add_lazy_region(start, size);
+#else
+            auto res = mrm->replace_region(start, size, prot);
+            DR_ASSERT(res == mem_region_manager::result::SUCCESS);
+#endif
+        });
     }
 
     {
@@ -509,8 +1395,10 @@ static void init_address_space() {
         DR_ASSERT(success);
     }
 
-    mrm->persist_new_region_table();
-    mrm->commit_new_region_table();
+    if (!instrument_args.recovered) {
+        mrm->persist_new_region_table();
+        mrm->commit_new_region_table();
+    }
 }
 
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
@@ -524,9 +1412,14 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
         if (recovered_tail != -1) { // A commit record was present.
             instrument_args.recovered_tail = recovered_tail;
         }
+#if OPTIMIZE_LAZY_REPLACE
+        // Regions that haven't been replaced are still to be replaced lazily.
+        init_address_space();
+#endif
     } else {
         init_address_space();
     }
+    ul::undo_log_reset_regions(mrm);
 
     // After applying the undo log, ask the foreground to recover memory pages.
     if (instrument_args.recovered) {
@@ -547,6 +1440,8 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
             DR_ASSERT(written >= 0);
             DR_ASSERT(written == sizeof(recovered_tail));
         }
+        // Again, for the foreground to make private copies of the regions' pages (see `warm_recovered_regions`).
+        mrm->send_regions(send_fd);
         if (my_close(send_fd) != 0) {
             DR_ASSERT_MSG(false, "closing write end of btf pipe failed");
         }
@@ -569,13 +1464,32 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
     if (!drutil_init())
         DR_ASSERT(false);
 
-    drreg_options_t ops = {sizeof(ops), 3, false, nullptr, false};
+    // Three scratch registers and the arithmetic flags for the inlined fast path, plus one for drutil.
+    drreg_options_t ops = {sizeof(ops), 5, false, nullptr, false};
     if (drreg_init(&ops) != DRREG_SUCCESS)
         DR_ASSERT(false);
 
     if (!drwrap_init())
         DR_ASSERT(false);
 
+#if OPTIMIZE_TRACE_BUFFER
+    if (!drx_init())
+        DR_ASSERT(false);
+    write_buf = drx_buf_create_trace_buffer(WRITE_BUF_SIZE_B, write_buf_full);
+    DR_ASSERT(write_buf != nullptr);
+    write_buf_pending_tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(write_buf_pending_tls_idx != -1);
+#endif
+
+#if OPTIMIZE_SKIP_STACK
+    if (!dr_raw_tls_calloc(&stack_tls_seg, &stack_tls_offs, NUM_STACK_TLS_SLOTS, /* alignment */ 0) ||
+        !drvector_init(&thread_stacks, /* initial capacity */ 8, /* synch */ true, nullptr) ||
+        !drmgr_register_thread_init_event(event_thread_init) ||
+        !drmgr_register_thread_exit_event(event_thread_exit_stack)) {
+        DR_ASSERT(false);
+    }
+#endif
+
     for (auto func : {
              reinterpret_cast<app_pc>(instrument_commit),
              reinterpret_cast<app_pc>(instrument_cleanup),
@@ -588,12 +1502,46 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
                                    /* override */ false))
             DR_ASSERT(false);
     }
+    trusted_call_depth_tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(trusted_call_depth_tls_idx != -1);
+    if (!drwrap_replace_native(reinterpret_cast<app_pc>(psm_undo_trusted_call),
+                               reinterpret_cast<app_pc>(replace_undo_trusted_call),
+                               /* at_entry */ false,
+                               /* stack_adjust */ 0,
+                               /* use_data */ nullptr,
+                               /* override */ false))
+        DR_ASSERT(false);
+    if (!drwrap_replace_native(reinterpret_cast<app_pc>(instrument_declare_write),
+                               reinterpret_cast<app_pc>(replace_declare_write),
+                               /* at_entry */ false,
+                               /* stack_adjust */ 0,
+                               /* use_data */ nullptr,
+                               /* override */ false))
+        DR_ASSERT(false);
 
     if (!drmgr_register_bb_app2app_event(event_bb_app2app, nullptr) ||
+#if OPTIMIZE_BATCH_FENCE
+        !drmgr_register_bb_instrumentation_event(event_bb_analysis, event_app_instruction, nullptr)) {
+#else
         !drmgr_register_bb_instrumentation_event(nullptr, event_app_instruction, nullptr)) {
+#endif
         DR_ASSERT(false);
     }
 
+#if OPTIMIZE_FRESH_HEAP_OBJECTS
+    hashtable_init(&fresh_objects, /* num_bits */ 10, HASH_INTPTR, /* str_dup */ false);
+    never_allocated = new (dr_global_alloc(sizeof(*never_allocated))) high_water();
+    realloc_call_tls_idx = drmgr_register_tls_field();
+    if (realloc_call_tls_idx == -1 || !drmgr_register_thread_exit_event(event_thread_exit_realloc)) {
+        DR_ASSERT(false);
+    }
+#endif
+#if OPTIMIZE_WRAP_BULK_FUNCS || OPTIMIZE_FRESH_HEAP_OBJECTS
+    if (!drmgr_register_module_load_event(event_module_load)) {
+        DR_ASSERT(false);
+    }
+#endif
+
     dr_register_filter_syscall_event(event_filter_syscall);
     if (!drmgr_register_pre_syscall_event(event_pre_syscall)) {
         DR_ASSERT(false);
@@ -7,18 +7,31 @@
 
 #define MEM_REGION_LOGGING 0
 
-// mem_ADDR_FILEID
-constexpr size_t FILE_NAME_BUF_LEN = 4 + 16 + 1 + 8 + 1;
+// arena_FILEID
+constexpr size_t FILE_NAME_BUF_LEN = 6 + 8 + 1;
 
+// The page-heat profile, written by the background (see `page_heat`) and read by the foreground on recovery to
+// bring back the hottest pages first.  It's an array of HEAT_SLOTS entries; entries with zero count are unused.
+constexpr const char *HEAT_FILE_NAME = "page_heat.dat";
+constexpr size_t HEAT_SLOTS = 1u << 14u;
+
+struct heat_entry {
+    uint64_t page; // Address of the page.
+    uint64_t count;
+};
+
+// A memory region, backed by [offset, offset + size) of arena file `file_id`.
 struct region {
     char *base;
     size_t size;
     uint file_id;
+    uint slot; // Index in the region table (see `mem_region_manager`); only meaningful in the background.
+    uint64_t offset;
 
     [[nodiscard]] char *end() const { return base + size; }
 
-    region(void *_base, size_t _size, uint _file_id)
-        : base(reinterpret_cast<char *>(_base)), size(_size), file_id(_file_id) {}
+    region(void *_base, size_t _size, uint _file_id, uint64_t _offset = 0)
+        : base(reinterpret_cast<char *>(_base)), size(_size), file_id(_file_id), slot(0), offset(_offset) {}
 
     [[nodiscard]] bool does_include(void *_addr) const {
         char *addr = reinterpret_cast<char *>(_addr);
@@ -41,11 +54,11 @@ struct region {
         static_assert(N >= FILE_NAME_BUF_LEN, "buffer too small");
 
         char *ptr = buf;
-        *ptr++ = 'm';
+        *ptr++ = 'a';
+        *ptr++ = 'r';
         *ptr++ = 'e';
-        *ptr++ = 'm';
-        *ptr++ = '_';
-        ptr = write_hex(ptr, reinterpret_cast<uintptr_t>(base));
+        *ptr++ = 'n';
+        *ptr++ = 'a';
         *ptr++ = '_';
         ptr = write_hex(ptr, file_id);
         *ptr = '\0';
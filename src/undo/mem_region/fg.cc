@@ -1,15 +1,21 @@
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
+#include <iterator>
+#include <thread>
+#include <vector>
 
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include "../my_libc/my_libc.h"
 #include "common.h"
+#include "fg.h"
 
 // This function should not use any memory other than the stack---
 // because memory pages are getting replaced, this function can observe
-// inconsistency in memory content between `mmap` and `read`.
+// inconsistency in memory content between one `mmap` and the next.
 int map_recovered_regions(const char *pmem_path, int pipe_fd) {
     int pmem_dirfd = my_open(pmem_path, O_DIRECTORY);
     if (pmem_dirfd < 0) {
@@ -27,25 +33,19 @@ int map_recovered_regions(const char *pmem_path, int pipe_fd) {
             break;
         }
 
-        void *addr = my_mmap(r.base, r.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
-        // FIXME(zhangwen): what does `my_mmap` return on error?
-        if (addr != r.base) {
-            return EINVAL;
-        }
-
         char file_name[FILE_NAME_BUF_LEN];
         r.make_file_name(file_name);
-        int fd = my_openat(pmem_dirfd, file_name, O_RDWR);
+        int fd = my_openat(pmem_dirfd, file_name, O_RDONLY);
         if (fd < 0) {
             return -fd;
         }
 
-        int region_nread = my_read(fd, addr, r.size);
-        if (region_nread < 0) {
-            return -region_nread;
-        }
-        if ((size_t)region_nread < r.size) {
-            return EAGAIN;
+        // Pages are read from the arena lazily, and copied on write (see `warm_recovered_regions`).
+        void *addr = my_mmap(r.base, r.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                             static_cast<off_t>(r.offset));
+        if (addr != r.base) {
+            auto ret_n = reinterpret_cast<size_t>(addr);
+            return ret_n > -4096UL ? -static_cast<int>(ret_n) : EINVAL;
         }
 
         if (int ret = my_close(fd); ret != 0) {
@@ -62,3 +62,117 @@ int map_recovered_regions(const char *pmem_path, int pipe_fd) {
     }
     return 0;
 }
+
+int read_recovered_regions(int pipe_fd, std::vector<region> *regions) {
+    while (true) {
+        region r(nullptr, 0, 0);
+
+        if (int nread = my_read(pipe_fd, &r, sizeof(r)); nread < 0 || static_cast<size_t>(nread) < sizeof(r)) {
+            return EINVAL;
+        }
+
+        if (r.base == nullptr && r.size == 0) { // Sentinel.
+            break;
+        }
+        regions->push_back(r);
+    }
+    return 0;
+}
+
+// Adding zero atomically forces a private copy of the page at `addr` without racing with the application's own
+// writes to it.  Faults if the page is no longer mapped writable, so it's only used before the application resumes.
+static void warm_page(char *addr) { __atomic_fetch_add(addr, 0, __ATOMIC_RELAXED); }
+
+// Whether `addr` is in one of `regions` (which are sorted by base).
+static bool is_recovered(const std::vector<region> &regions, char *addr) {
+    auto it = std::upper_bound(regions.begin(), regions.end(), addr,
+                               [](const char *a, const region &r) { return a < r.base; });
+    return it != regions.begin() && std::prev(it)->does_include(addr);
+}
+
+int warm_hot_pages(const char *pmem_path, const std::vector<region> &regions) {
+    // Hot pages are copied using up to this many threads.
+    constexpr unsigned WARM_THREADS = 8;
+
+    int pmem_dirfd = my_open(pmem_path, O_DIRECTORY);
+    if (pmem_dirfd < 0) {
+        return -pmem_dirfd;
+    }
+    int fd = my_openat(pmem_dirfd, HEAT_FILE_NAME, O_RDONLY);
+    if (int ret = my_close(pmem_dirfd); ret != 0) {
+        return -ret;
+    }
+    if (fd == -ENOENT) {
+        return 0;
+    }
+    if (fd < 0) {
+        return -fd;
+    }
+
+    std::vector<heat_entry> entries(HEAT_SLOTS);
+    ssize_t nread = my_pread(fd, entries.data(), sizeof(heat_entry) * entries.size(), /* offset */ 0);
+    if (int ret = my_close(fd); ret != 0) {
+        return -ret;
+    }
+    if (nread < 0) {
+        return static_cast<int>(-nread);
+    }
+    entries.resize(nread / sizeof(heat_entry));
+
+    // Pages no longer mapped (e.g., unmapped since they were profiled) are dropped.
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                                 [&regions](const heat_entry &e) {
+                                     return e.count == 0 || !is_recovered(regions, reinterpret_cast<char *>(e.page));
+                                 }),
+                  entries.end());
+    std::sort(entries.begin(), entries.end(),
+              [](const heat_entry &a, const heat_entry &b) { return a.count > b.count; });
+
+    // Threads take pages in turn, so the hottest pages are copied first.
+    const unsigned num_threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), WARM_THREADS);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; t++) {
+        threads.emplace_back([&entries, t, num_threads]() {
+            for (size_t i = t; i < entries.size(); i += num_threads) {
+                warm_page(reinterpret_cast<char *>(entries[i].page));
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+#if MEM_REGION_LOGGING
+    fprintf(stderr, "[fg: warm_hot_pages] warmed %zu hot pages\n", entries.size());
+#endif
+    return 0;
+}
+
+bool can_warm_concurrently() {
+    // The advice is checked before the (empty) range.
+    alignas(4096) static char probe;
+    return my_madvise(&probe, 0, MADV_POPULATE_WRITE) == 0;
+}
+
+void warm_recovered_regions(const std::vector<region> &regions) {
+    const long page_size = sysconf(_SC_PAGESIZE);
+    const bool concurrent = can_warm_concurrently();
+    for (const region &r : regions) {
+        if (!concurrent) {
+            for (size_t off = 0; off < r.size; off += page_size) {
+                warm_page(r.base + off);
+            }
+            continue;
+        }
+
+        // Populating writable breaks copy-on-write like a write would, but fails instead of faulting if the
+        // application has changed the mapping (e.g., with munmap or mremap), in which case the rest of the region
+        // is done page by page, skipping the pages that fail.
+        if (my_madvise(r.base, r.size, MADV_POPULATE_WRITE) == 0) {
+            continue;
+        }
+        for (size_t off = 0; off < r.size; off += page_size) {
+            my_madvise(r.base + off, page_size, MADV_POPULATE_WRITE);
+        }
+    }
+}
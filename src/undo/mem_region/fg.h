@@ -1,9 +1,33 @@
 #ifndef PSM_SRC_UNDO_MEM_REGION_FG_H
 #define PSM_SRC_UNDO_MEM_REGION_FG_H
 
+#include <vector>
+
+#include "common.h"
+
 // Maps recovered regions (sent by background process through fd) in foreground process.
 // Returns 0 on success, errno on failure.
 // Closes fd afterwards.
 int map_recovered_regions(const char *pmem_path, int read_fd);
 
+// Reads the list of mapped regions (sent again by the background through fd), sorted by base.
+// Returns 0 on success, errno on failure.
+int read_recovered_regions(int read_fd, std::vector<region> *regions);
+
+// Makes private copies of the hottest pages of the mapped regions, as recorded in the page-heat profile (see
+// HEAT_FILE_NAME), using several threads; returns once they're all copied.  Does nothing if there's no profile.
+// Returns 0 on success, errno on failure.
+int warm_hot_pages(const char *pmem_path, const std::vector<region> &regions);
+
+// Whether `warm_recovered_regions` can run concurrently with the application, which needs MADV_POPULATE_WRITE
+// (Linux 5.14 or later).
+bool can_warm_concurrently();
+
+// Makes private copies of all pages of the mapped regions, so that they no longer reflect the region files,
+// which the background is about to modify.
+// If `can_warm_concurrently()`, this is safe to run concurrently with the application: pages that the application
+// has unmapped or remapped meanwhile are skipped (rather than faulted on).  Otherwise, it must finish before the
+// application resumes.
+void warm_recovered_regions(const std::vector<region> &regions);
+
 #endif //PSM_SRC_UNDO_MEM_REGION_FG_H
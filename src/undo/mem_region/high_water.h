@@ -0,0 +1,127 @@
+#ifndef PSM_SRC_UNDO_MEM_REGION_HIGH_WATER_H
+#define PSM_SRC_UNDO_MEM_REGION_HIGH_WATER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "dr_api.h"
+
+// Tracks which memory an allocator has never handed out, as a high-water mark per mapping: the part of a mapping
+// at or above its mark hasn't been handed out (since it was mapped), and everything below it might have been.
+// Allocators mostly carve new objects out of the top of their mappings, so this is nearly exact for them, and
+// being conservative elsewhere only means that an object isn't treated as never handed out.
+//
+// The untouched parts, i.e., [mark, end) of each mapping, are kept in an array sorted by address, so a lookup is a
+// binary search, and handing out memory just raises a mark in place.
+class high_water {
+  public:
+    high_water() : tails(nullptr), num_tails(0), capacity(0) {}
+
+    ~high_water() {
+        if (tails != nullptr) {
+            dr_global_free(tails, sizeof(tail) * capacity);
+        }
+    }
+
+    high_water(const high_water &) = delete;
+    high_water &operator=(const high_water &) = delete;
+
+    // A new mapping [start, start + size), which hasn't been handed out.
+    void add_mapping(uintptr_t start, size_t size) {
+        if (size == 0) {
+            return;
+        }
+        remove_mapping(start, size); // In case an unmapping was missed.
+        insert_at(upper_bound(start), tail{start, start + size});
+    }
+
+    // Unmaps [start, start + size).
+    void remove_mapping(uintptr_t start, size_t size) {
+        const uintptr_t end = start + size;
+        // Only the tails starting before `end` can overlap, and they are sorted (and disjoint), so the ones that do
+        // are the last few of those.
+        for (size_t i = upper_bound(end - 1); i > 0 && tails[i - 1].end > start; i--) {
+            tail &t = tails[i - 1];
+            if (t.start < start && end < t.end) { // Split in two.
+                const tail right{end, t.end};
+                t.end = start;
+                insert_at(i, right);
+            } else if (t.start < start) {
+                t.end = start;
+            } else if (end < t.end) {
+                t.start = end;
+            } else {
+                erase_at(i - 1);
+            }
+        }
+    }
+
+    // Marks [start, start + size) as handed out.  Returns whether none of it had been handed out before.
+    bool allocate(uintptr_t start, size_t size) {
+        if (size == 0 || num_tails == 0) {
+            return false;
+        }
+        const uintptr_t end = start + size;
+        size_t i = upper_bound(end - 1);
+        if (i == 0 || tails[i - 1].end <= start) { // Usually, the memory is being reused.
+            return false;
+        }
+        tail &t = tails[i - 1];
+        const bool fresh = t.start <= start && end <= t.end;
+        t.start = std::min(end, t.end);
+        // Memory spanning mappings takes the tails below with it (which are then dropped, conservatively).
+        for (; i > 1 && tails[i - 2].end > start; i--) {
+            tails[i - 2].start = tails[i - 2].end;
+        }
+        return fresh;
+    }
+
+  private:
+    struct tail {
+        uintptr_t start; // The mapping's high-water mark.
+        uintptr_t end;   // The end of the mapping.
+    };
+
+    tail *tails; // Array of `capacity`, sorted by `start`, and disjoint.  Might include empty ones.
+    size_t num_tails;
+    size_t capacity;
+
+    // Returns the index of the first tail starting after `addr`.
+    [[nodiscard]] size_t upper_bound(uintptr_t addr) const {
+        size_t lo = 0, hi = num_tails;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (tails[mid].start <= addr) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    void insert_at(size_t i, const tail &t) {
+        if (num_tails == capacity) {
+            size_t new_capacity = capacity == 0 ? 16 : capacity * 2;
+            auto new_tails = static_cast<tail *>(dr_global_alloc(sizeof(tail) * new_capacity));
+            if (tails != nullptr) {
+                memcpy(new_tails, tails, sizeof(tail) * num_tails);
+                dr_global_free(tails, sizeof(tail) * capacity);
+            }
+            tails = new_tails;
+            capacity = new_capacity;
+        }
+        memmove(&tails[i + 1], &tails[i], sizeof(tail) * (num_tails - i));
+        tails[i] = t;
+        ++num_tails;
+    }
+
+    void erase_at(size_t i) {
+        memmove(&tails[i], &tails[i + 1], sizeof(tail) * (num_tails - i - 1));
+        --num_tails;
+    }
+};
+
+#endif // PSM_SRC_UNDO_MEM_REGION_HIGH_WATER_H
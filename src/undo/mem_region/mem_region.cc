@@ -1,69 +1,270 @@
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <new>
-#include <limits>
 
 #include <fcntl.h>
+#include <immintrin.h>
+#include <linux/falloc.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "dr_api.h"
 #include "dr_tools.h"
-#include "drvector.h"
 
 #include "mem_region.h"
 #include "common.h"
+#include "../flush.h"
 
 #include "../my_libc/my_libc.h"
+#include "../raw_thread.h"
 
 using result = mem_region_manager::result;
 
+// Regions are copied to their files in units of this many bytes (regions are page-aligned).
+constexpr size_t PERSIST_COPY_UNIT_B = 128;
+// All-zero pages of this many bytes are left as holes in arena files.
+constexpr size_t PERSIST_PAGE_B = 4096;
+// Regions at least this large are copied by PERSIST_THREADS threads.
+constexpr size_t PARALLEL_PERSIST_MIN_B = 64ul << 20u;
+constexpr int PERSIST_THREADS = 8;
+
+static void print_error(const char *description, int err) {
+    dr_fprintf(STDERR, "ERROR: %s\terrno = %d\n", description, err);
+}
+
+// Rounds `size` up to a whole number of pages.  The kernel maps and unmaps whole pages, so this is the space a
+// mapping of `size` bytes takes up; keeping arena space in whole pages keeps every position page-aligned.
+static size_t page_align(size_t size) {
+    const size_t page_size = dr_page_size();
+    return (size + page_size - 1) & ~(page_size - 1);
+}
+
 mem_region_manager::mem_region_manager(const char *_pmem_path)
-    : pmem_path(_pmem_path), pmem_dirfd(my_open(_pmem_path, O_DIRECTORY)), regions{} {
+    : pmem_path(_pmem_path), pmem_dirfd(my_open(_pmem_path, O_DIRECTORY)), regions(nullptr), num_regions(0),
+      regions_capacity(0), table(nullptr), next_slot(0),
+      working_ready(false), arena_fds{}, num_arenas(0) {
     DR_ASSERT_MSG(pmem_dirfd >= 0, "open directory");
 
-    bool success = drvector_init(&regions, /* initial capacity */ 10, false, nullptr);
-    DR_ASSERT(success);
+    map_table();
 }
 
 mem_region_manager::~mem_region_manager() {
-    drvector_delete(&regions);
+    for (int i = 0; i < num_arenas; i++) {
+        my_close(arena_fds[i]);
+    }
+    my_munmap(table, sizeof(region_table));
+    if (regions != nullptr) {
+        dr_global_free(regions, sizeof(region) * regions_capacity);
+    }
     my_close(pmem_dirfd);
 }
 
-void mem_region_manager::recover() {
-    int table_fd = my_openat(pmem_dirfd, CURRENT_TABLE_FILE_NAME, O_RDONLY);
-    DR_ASSERT_MSG(table_fd >= 0, "open region table file failed");
+// Opens the existing arena files, making all of their space free.
+bool mem_region_manager::open_arenas() {
+    DR_ASSERT(num_arenas == 0);
+    while (num_arenas < MAX_ARENAS) {
+        char file_name[FILE_NAME_BUF_LEN];
+        region(nullptr, 0, num_arenas).make_file_name(file_name);
+        int fd = my_openat(pmem_dirfd, file_name, O_RDWR);
+        if (fd == -ENOENT) {
+            break;
+        }
+        if (fd < 0) {
+            print_error("open_arenas -- openat", -fd);
+            return false;
+        }
+        arena_fds[num_arenas] = fd;
+        free_space.insert(num_arenas * ARENA_SIZE_B, ARENA_SIZE_B);
+        ++num_arenas;
+    }
+    return true;
+}
+
+// Creates a new (empty) arena file, discarding any file of the same name left over from a previous run.
+bool mem_region_manager::add_arena() {
+    if (num_arenas == MAX_ARENAS) {
+        dr_fprintf(STDERR, "ERROR: add_arena -- too many arenas\n");
+        return false;
+    }
+
+    char file_name[FILE_NAME_BUF_LEN];
+    region(nullptr, 0, num_arenas).make_file_name(file_name);
+    int fd = my_openat(pmem_dirfd, file_name, O_CREAT | O_RDWR, 0666);
+    if (fd < 0) {
+        print_error("add_arena -- openat", -fd);
+        return false;
+    }
+    if (int ret = my_ftruncate(fd, 0); ret < 0) {
+        print_error("add_arena -- ftruncate", -ret);
+        my_close(fd);
+        return false;
+    }
+    if (int ret = my_ftruncate(fd, ARENA_SIZE_B); ret < 0) {
+        print_error("add_arena -- ftruncate", -ret);
+        my_close(fd);
+        return false;
+    }
+    // Unlike the region table, arenas are rarely added, so syncing here is fine.
+    if (int ret = my_fsync(fd); ret < 0) {
+        print_error("add_arena -- fsync(fd)", -ret);
+        my_close(fd);
+        return false;
+    }
+    if (int ret = my_fsync(pmem_dirfd); ret < 0) {
+        print_error("add_arena -- fsync(pmem_dirfd)", -ret);
+        my_close(fd);
+        return false;
+    }
+
+    arena_fds[num_arenas] = fd;
+    free_space.insert(num_arenas * ARENA_SIZE_B, ARENA_SIZE_B);
+    ++num_arenas;
+    return true;
+}
+
+// Allocates `size` bytes (rounded up to whole pages) of (zero) arena space within one arena, adding an arena if
+// needed.  The space is page-aligned.
+bool mem_region_manager::alloc_space(size_t size, uint64_t *pos) {
+    size = page_align(size);
+    if (size > ARENA_SIZE_B) {
+        dr_fprintf(STDERR, "ERROR: alloc_space -- region too large: %lu\n", size);
+        return false;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool found = false;
+        uint64_t at = 0;
+        // First fit.
+        free_space.foreach([size, &found, &at](uint64_t start, size_t len) {
+            if (found) {
+                return;
+            }
+            uint64_t s = start;
+            if (s / ARENA_SIZE_B != (s + size - 1) / ARENA_SIZE_B) { // Don't span arenas.
+                s = (s / ARENA_SIZE_B + 1) * ARENA_SIZE_B;
+            }
+            if (s + size <= start + len) {
+                found = true;
+                at = s;
+            }
+        });
+        if (found) {
+            DR_ASSERT_MSG(at % dr_page_size() == 0, "arena space not page-aligned");
+            free_space.remove(at, size);
+            *pos = at;
+            return true;
+        }
+        if (attempt == 0 && !add_arena()) {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Deallocates the blocks backing [pos, pos + size) (which must be within one arena), so that it reads as zeros.
+bool mem_region_manager::punch_hole(uint64_t pos, size_t size) {
+    int fd = arena_fds[pos / ARENA_SIZE_B];
+    if (int ret = my_fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos % ARENA_SIZE_B, size); ret < 0) {
+        print_error("punch_hole -- fallocate", -ret);
+        return false;
+    }
+    return true;
+}
 
-    region r(nullptr, 0, 0);
-    int nread;
-    while ((nread = my_read(table_fd, &r, sizeof(r))) > 0) {
-        DR_ASSERT_MSG(static_cast<size_t>(nread) == sizeof(r), "read too little");
+// Calls `f(pos, len)` on each part of the arena space [start, start + len) that lies within one arena.
+template <typename F> static void foreach_arena_piece(uint64_t start, size_t len, uint64_t arena_size, F f) {
+    for (uint64_t pos = start; pos < start + len;) {
+        uint64_t next = std::min(start + len, (pos / arena_size + 1) * arena_size);
+        f(pos, next - pos);
+        pos = next;
+    }
+}
 
+// Makes the space freed since the previous commit reusable.  Should only be called once no committed region
+// table refers to it.
+void mem_region_manager::release_pending_free() {
+    static_assert(MAX_ARENAS <= 64, "arena bitmasks don't fit in a word");
+    // Reused space is trusted to read as zeros (see `replace_region`), but punched holes aren't durable until
+    // the arena is synced; otherwise, a crash could bring back stale data in a region that never wrote it.
+    // So each arena with holes punched is synced once, and its space is reused only if that all succeeded.
+    uint64_t punched = 0, failed = 0;
+    pending_free.foreach([this, &punched, &failed](uint64_t start, size_t len) {
+        // Coalesced ranges might span arenas.
+        foreach_arena_piece(start, len, ARENA_SIZE_B, [this, &punched, &failed](uint64_t pos, size_t size) {
+            const uint64_t arena_bit = 1ull << (pos / ARENA_SIZE_B);
+            punched |= arena_bit;
+            if (!punch_hole(pos, size)) {
+                failed |= arena_bit;
+            }
+        });
+    });
+    for (int i = 0; i < num_arenas; i++) {
+        if ((punched & ~failed) & (1ull << i)) {
+            if (int ret = my_fsync(arena_fds[i]); ret < 0) {
+                print_error("release_pending_free -- fsync", -ret);
+                failed |= 1ull << i;
+            }
+        }
+    }
+    pending_free.foreach([this, failed](uint64_t start, size_t len) {
+        foreach_arena_piece(start, len, ARENA_SIZE_B, [this, failed](uint64_t pos, size_t size) {
+            if (!(failed & (1ull << (pos / ARENA_SIZE_B)))) {
+                free_space.insert(pos, size);
+            } // Otherwise, the space is leaked (until the next recovery).
+        });
+    });
+    pending_free.clear();
+
+    // Delete trailing arenas that no committed region refers to anymore (keeping the first one around).
+    while (num_arenas > 1 && free_space.find((num_arenas - 1) * ARENA_SIZE_B, ARENA_SIZE_B)) {
         char file_name[FILE_NAME_BUF_LEN];
-        r.make_file_name(file_name);
-        int fd = my_openat(pmem_dirfd, file_name, O_RDWR);
-        DR_ASSERT_MSG(fd >= 0, "open region file failed");
+        region(nullptr, 0, num_arenas - 1).make_file_name(file_name);
+        if (int ret = my_unlinkat(pmem_dirfd, file_name, /* flags */ 0); ret < 0) {
+            print_error("release_pending_free -- unlinkat", -ret);
+            break;
+        }
+        my_close(arena_fds[--num_arenas]);
+        free_space.remove(num_arenas * ARENA_SIZE_B, ARENA_SIZE_B);
+#if MEM_REGION_LOGGING
+        dr_fprintf(STDERR, "[bg: release_pending_free] arena deleted:\t%x\n", num_arenas);
+#endif
+    }
+}
 
-        void *ret = my_mmap(r.base, r.size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED_VALIDATE | MAP_SYNC, fd,
-            /* offset */ 0);
-        DR_ASSERT_MSG(ret != MAP_FAILED, "mmap memory region file failed");
-        DR_ASSERT_MSG(ret == r.base, "mmap returned a different address?");
+void mem_region_manager::recover() {
+    bool success = open_arenas();
+    DR_ASSERT_MSG(success, "open arena files failed");
 
-        if (my_close(fd) < 0) {
-            DR_ASSERT_MSG(false, "close region file failed");
+    const uint64_t *valid = table->valid[active_bitmap()];
+    for (uint slot = 0; slot < MAX_SLOTS; slot++) {
+        if (!(valid[slot / 64] & (1ull << (slot % 64)))) {
+            continue;
         }
+        region r = table->slots[slot];
+        r.slot = slot;
+
+        DR_ASSERT_MSG(r.file_id < static_cast<uint>(num_arenas), "region in a missing arena");
+        void *ret = my_mmap(r.base, r.size, PROT_READ | PROT_WRITE, MAP_FIXED | MAP_SHARED_VALIDATE | MAP_SYNC,
+                            arena_fds[r.file_id], static_cast<off_t>(r.offset));
+        DR_ASSERT_MSG(ret != MAP_FAILED, "mmap arena file failed");
+        DR_ASSERT_MSG(ret == r.base, "mmap returned a different address?");
 
-        void *mem = dr_global_alloc(sizeof(region));
-        drvector_append(&regions, new (mem) region(r));
-        rs.insert(reinterpret_cast<uintptr_t>(r.base), r.size);
+        insert_region(r);
+        pages.insert(reinterpret_cast<uintptr_t>(r.base), r.size);
+        free_space.remove(r.file_id * ARENA_SIZE_B + r.offset, page_align(r.size));
 
 #if MEM_REGION_LOGGING
         dr_fprintf(STDERR, "[bg: mem_region_manager::recover] region recovered:\t\t%lx-%lx\n", r.base, r.base + r.size);
 #endif
     }
-    DR_ASSERT_MSG(nread == 0, "read region table failed");
-    if (my_close(table_fd) < 0) {
-        DR_ASSERT_MSG(false, "close region table file failed");
-    }
+    reset_working_bitmap();
+
+    // Space not in the table might hold data of regions removed before the crash.
+    pending_free.clear();
+    free_space.foreach([this](uint64_t start, size_t len) { pending_free.insert(start, len); });
+    free_space.clear();
+    release_pending_free();
 
 #if MEM_REGION_LOGGING
     dr_fprintf(STDERR, "[bg: mem_region_manager::recover] memory region manager recovery done!\n");
@@ -71,8 +272,8 @@ void mem_region_manager::recover() {
 }
 
 void mem_region_manager::send_regions(int fd) const {
-    for (uint i = 0; i < regions.entries; i++) {
-        auto r = static_cast<const region *>(regions.array[i]);
+    for (uint i = 0; i < num_regions; i++) {
+        const region *r = &regions[i];
         int written = my_write(fd, r, sizeof(*r));
         DR_ASSERT_MSG(written >= 0, "send_regions: write failed");
         DR_ASSERT_MSG(written == sizeof(*r), "send_regions: written less than asked");
@@ -84,142 +285,250 @@ void mem_region_manager::send_regions(int fd) const {
     DR_ASSERT_MSG(written == sizeof(sentinel), "send_regions: written less than asked");
 }
 
-bool mem_region_manager::does_manage(app_pc addr) const { return rs.find(reinterpret_cast<uintptr_t>(addr)); }
+bool mem_region_manager::does_manage(app_pc addr) const { return pages.test(reinterpret_cast<uintptr_t>(addr)); }
+
+void mem_region_manager::add_lazy_region(app_pc base, size_t size) {
+    // Skip pages that are managed already (e.g., after recovery).
+    const size_t page_size = dr_page_size();
+    auto p = reinterpret_cast<uintptr_t>(base);
+    const uintptr_t end = p + size;
+    while (p < end) {
+        if (pages.test(p)) {
+            p += page_size;
+            continue;
+        }
+        uintptr_t run_end = p + page_size;
+        for (; run_end < end && !pages.test(run_end); run_end += page_size)
+            ;
+        lazy.insert(p, run_end - p);
+        p = run_end;
+    }
+}
 
-int mem_region_manager::find_overlap(const region &other) const {
-    for (uint i = 0; i < regions.entries; i++) {
-        const auto *r = static_cast<const region *>(regions.array[i]);
-        if (r->does_overlap_with(other)) {
-            return i;
+result mem_region_manager::replace_lazy(uintptr_t addr, size_t size, void (*on_replaced)(app_pc base, size_t size)) {
+    const size_t page_size = dr_page_size();
+    for (uintptr_t chunk = addr & ~(LAZY_CHUNK_B - 1); chunk < addr + size; chunk += LAZY_CHUNK_B) {
+        const uintptr_t chunk_end = chunk + LAZY_CHUNK_B;
+        uintptr_t p = chunk;
+        while (p < chunk_end) {
+            if (!lazy.test(p)) {
+                p += page_size;
+                continue;
+            }
+            uintptr_t run_end = p + page_size;
+            for (; run_end < chunk_end && lazy.test(run_end); run_end += page_size)
+                ;
+
+            // The run might span mappings with different protections.
+            while (p < run_end) {
+                dr_mem_info_t info;
+                if (!dr_query_memory_ex(reinterpret_cast<app_pc>(p), &info)) {
+                    return result::ERROR;
+                }
+                uintptr_t piece_end = std::min(run_end, reinterpret_cast<uintptr_t>(info.base_pc) + info.size);
+                lazy.remove(p, piece_end - p);
+                if (replace_region(reinterpret_cast<app_pc>(p), piece_end - p, to_mmap_prot(info.prot)) ==
+                    result::ERROR) {
+                    return result::ERROR;
+                }
+                on_replaced(reinterpret_cast<app_pc>(p), piece_end - p);
+                p = piece_end;
+            }
         }
     }
+    return result::SUCCESS;
+}
+
+uint mem_region_manager::lower_bound(const char *addr) const {
+    uint lo = 0, hi = num_regions;
+    while (lo < hi) {
+        uint mid = lo + (hi - lo) / 2;
+        if (regions[mid].base < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
 
+int mem_region_manager::find_overlap(const region &other) const {
+    // Regions are disjoint, so only the last one starting before `other` ends can overlap with it.
+    uint i = lower_bound(other.end());
+    if (i > 0 && regions[i - 1].does_overlap_with(other)) {
+        return static_cast<int>(i - 1);
+    }
     return -1;
 }
 
-static void print_error(const char *description, int err) {
-    dr_fprintf(STDERR, "ERROR: %s\terrno = %d\n", description, err);
+void mem_region_manager::insert_region(const region &r) {
+    if (num_regions == regions_capacity) {
+        uint new_capacity = regions_capacity == 0 ? 16 : regions_capacity * 2;
+        auto new_regions = static_cast<region *>(dr_global_alloc(sizeof(region) * new_capacity));
+        if (regions != nullptr) {
+            memcpy(new_regions, regions, sizeof(region) * num_regions);
+            dr_global_free(regions, sizeof(region) * regions_capacity);
+        }
+        regions = new_regions;
+        regions_capacity = new_capacity;
+    }
+    uint i = lower_bound(r.base);
+    memmove(&regions[i + 1], &regions[i], sizeof(region) * (num_regions - i));
+    new (&regions[i]) region(r);
+    ++num_regions;
 }
 
-// Writes a memory region to the persistent memory file system.
-// Returns an open file descriptor to the file (RDWR), or -1 on error.
-int mem_region_manager::persist_region(app_pc base, size_t size, char *file_name) const {
-    int fd = my_openat(pmem_dirfd, file_name, O_CREAT | O_RDWR | O_EXCL, 0666);
-    if (fd < 0) {
-        print_error("persist_region -- openat", -fd);
-        goto err;
+void mem_region_manager::erase_region(uint i) {
+    DR_ASSERT(i < num_regions);
+    memmove(&regions[i], &regions[i + 1], sizeof(region) * (num_regions - i - 1));
+    --num_regions;
+}
+
+// Returns whether the `PERSIST_PAGE_B` bytes at `src` (which must be aligned) are all zero.
+static bool is_zero_page(const char *src) {
+    // (Only AVX is assumed, so the OR is done on the floating-point view.)
+    __m256 acc = _mm256_setzero_ps();
+    for (size_t off = 0; off < PERSIST_PAGE_B; off += sizeof(__m256)) {
+        acc = _mm256_or_ps(acc, _mm256_load_ps(reinterpret_cast<const float *>(src + off)));
     }
+    __m256i bits = _mm256_castps_si256(acc);
+    return _mm256_testz_si256(bits, bits);
+}
 
-    {
-        app_pc write_from = base;
-        size_t to_write = size;
-        while (to_write > 0) {
-            int nb = my_write(fd, write_from, to_write);
-            if (nb <= 0) {
-                print_error("persist_region -- write", -nb);
-                goto err;
-            }
-            write_from += nb;
-            to_write -= nb;
+// Copies `len` bytes with non-temporal stores, followed by a fence.  All-zero pages are skipped,
+// leaving holes in the (sparse) file, which read as zeros.
+// `dst`, `src`, and `len` must be multiples of PERSIST_PAGE_B.
+static void copy_nt(char *dst, const char *src, size_t len) {
+    DR_ASSERT(reinterpret_cast<uintptr_t>(dst) % PERSIST_PAGE_B == 0 &&
+              reinterpret_cast<uintptr_t>(src) % PERSIST_PAGE_B == 0 && len % PERSIST_PAGE_B == 0);
+    for (size_t page = 0; page < len; page += PERSIST_PAGE_B) {
+        if (is_zero_page(src + page)) {
+            continue;
+        }
+        for (size_t off = page; off < page + PERSIST_PAGE_B; off += PERSIST_COPY_UNIT_B) {
+            auto s = reinterpret_cast<const __m256i *>(src + off);
+            auto d = reinterpret_cast<__m256i *>(dst + off);
+            __m256i y0 = _mm256_load_si256(s), y1 = _mm256_load_si256(s + 1);
+            __m256i y2 = _mm256_load_si256(s + 2), y3 = _mm256_load_si256(s + 3);
+            _mm256_stream_si256(d, y0);
+            _mm256_stream_si256(d + 1, y1);
+            _mm256_stream_si256(d + 2, y2);
+            _mm256_stream_si256(d + 3, y3);
         }
     }
+    _mm_sfence();
+}
 
-    if (int ret = my_fsync(fd) < 0; ret < 0) {
-        print_error("persist_region -- fsync(fd)", -ret);
-        goto err;
+// Copies a memory region to arena space at `pos`, which must be all zeros: the space is mapped, and filled
+// with non-temporal stores (by several threads if the region is large), so that this is bound by memory
+// bandwidth rather than by syscalls.  All-zero pages are skipped.
+bool mem_region_manager::persist_region(app_pc base, size_t size, uint64_t pos) const {
+    // With MAP_SYNC, the file's metadata is persistent once a page fault on it returns,
+    // and the data is persistent once the non-temporal stores are fenced.
+    void *dst = my_mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC,
+                        arena_fds[pos / ARENA_SIZE_B], static_cast<off_t>(pos % ARENA_SIZE_B));
+    if (reinterpret_cast<uintptr_t>(dst) > -4096UL) {
+        print_error("persist_region -- mmap", -reinterpret_cast<intptr_t>(dst));
+        return false;
     }
 
-    if (int ret = my_fsync(pmem_dirfd); ret < 0) {
-        print_error("persist_region -- fsync(pmem_dirfd)", -ret);
-        goto err;
+    {
+        // Each thread copies whole pages (as `copy_nt` requires); the last one also takes the remainder.
+        const size_t num_pages = size / PERSIST_PAGE_B;
+        const int num_threads = size < PARALLEL_PERSIST_MIN_B ? 1 : PERSIST_THREADS;
+        run_in_parallel(num_threads, [dst, base, num_pages, num_threads](int t) {
+            size_t begin = num_pages / num_threads * t;
+            size_t end = t == num_threads - 1 ? num_pages : begin + num_pages / num_threads;
+            copy_nt(static_cast<char *>(dst) + begin * PERSIST_PAGE_B,
+                    reinterpret_cast<const char *>(base) + begin * PERSIST_PAGE_B, (end - begin) * PERSIST_PAGE_B);
+        });
     }
 
-    return fd;
-
-err:
-    if (fd >= 0) {
-        my_close(fd);
+    if (int ret = my_munmap(dst, size); ret < 0) {
+        print_error("persist_region -- munmap", -ret);
+        return false;
     }
-    return -1;
+    return true;
 }
 
-result mem_region_manager::replace_region(app_pc base, size_t size, int prot) {
-    uint file_id = dr_get_random_value(std::numeric_limits<uint>::max());
-    region r(base, size, file_id);
+result mem_region_manager::replace_region(app_pc base, size_t size, int prot, bool is_zero) {
+    // The mapping (e.g., from an application `mmap` of any length) takes up whole pages.
+    size = page_align(size);
+    uint64_t pos;
+    if (!alloc_space(size, &pos)) {
+        return result::ERROR;
+    }
+    region r(base, size, pos / ARENA_SIZE_B, pos % ARENA_SIZE_B);
     DR_ASSERT(-1 == find_overlap(r));
 
-    char file_name[FILE_NAME_BUF_LEN];
-    r.make_file_name(file_name);
-
-    int fd = persist_region(base, size, file_name);
-    if (fd == -1) {
+    if (!is_zero && !persist_region(base, size, pos)) {
+        pending_free.insert(pos, size);
         return result::ERROR;
     }
 
     // Replace the memory region.  I hope DynamoRIO is fine with me doing this.
     {
-        void *ret = my_mmap(base, size, prot, MAP_FIXED | MAP_SHARED_VALIDATE | MAP_SYNC, fd,
-                            /* offset */ 0);
+        void *ret = my_mmap(base, size, prot, MAP_FIXED | MAP_SHARED_VALIDATE | MAP_SYNC, arena_fds[r.file_id],
+                            static_cast<off_t>(r.offset));
         if (ret != base) {
             auto ret_n = reinterpret_cast<size_t>(ret);
             DR_ASSERT(ret_n > -4096UL);
             print_error("replace_region -- mmap", -ret_n);
+            pending_free.insert(pos, size);
             return result::ERROR;
         }
     }
 
-    if (int ret = my_close(fd); ret < 0) {
-        print_error("replace_region -- close", ret);
-        return result::ERROR;
-    }
-
 #if MEM_REGION_LOGGING
-    dr_fprintf(STDERR, "region replaced:\t%lx-%lx\tfile_id = %x\n", reinterpret_cast<uintptr_t>(base),
-               reinterpret_cast<uintptr_t>(base) + size, file_id);
+    dr_fprintf(STDERR, "region replaced:\t%lx-%lx\tarena = %x, offset = %lx\n", reinterpret_cast<uintptr_t>(base),
+               reinterpret_cast<uintptr_t>(base) + size, r.file_id, r.offset);
 #endif
 
-    void *mem = dr_global_alloc(sizeof(region));
-    drvector_append(&regions, new (mem) region(r));
-    rs.insert(reinterpret_cast<uintptr_t>(base), size);
+    add_to_table(&r);
+    insert_region(r);
+    pages.insert(reinterpret_cast<uintptr_t>(base), size);
     return result::SUCCESS;
 }
 
 result mem_region_manager::remove_region(app_pc base, size_t size) {
+    // As with `munmap`, the length is rounded up to whole pages.
+    size = page_align(size);
+    lazy.remove(reinterpret_cast<uintptr_t>(base), size);
+
     region remove_r(base, size, 0);
     int i = find_overlap(remove_r);
     if (i == -1) { // Not managed.  Ignore!
         return result::NOT_MANAGED;
     }
-    auto r = static_cast<region *>(regions.array[i]);
+    const region old = regions[i];
+    const region *r = &old;
     DR_ASSERT_MSG(r->does_include(remove_r), "doesn't support unmap across regions");
-    // Remove r from our vector of regions.
-    regions.array[i] = regions.array[--regions.entries];
+    erase_region(i);
 
     // First perform the `munmap`, then update our metadata.
     if (my_munmap(base, size) != 0) {
         return result::SUCCESS;
     }
 
-    // FIXME(zhangwen): implement garbage collection.
-    // FIXME(zhangwen): we don't remove the region from `rs`, which should be fine --
-    // the application shouldn't access munmap'ed memory anyway.
+    // The remainders (if any) stay mapped at their offsets in the arena, so they become regions of their own
+    // without copying.  Only the unmapped part's space is freed (once the new region table is committed).
+    const uint64_t removed_offset = r->offset + (remove_r.base - r->base);
+    pages.remove(reinterpret_cast<uintptr_t>(remove_r.base), remove_r.size);
+    pending_free.insert(r->file_id * ARENA_SIZE_B + removed_offset, remove_r.size);
+
+    remove_from_table(r);
 
     if (r->end() != remove_r.end()) {
         DR_ASSERT(r->end() > remove_r.end());
-        auto new_size = r->end() - remove_r.end();
-        // This will create a new file for region starting at `remove_r.end`.
-        auto end = reinterpret_cast<app_pc>(remove_r.end());
-        if (result::ERROR == replace_region(end, new_size, PROT_READ | PROT_WRITE)) {
-            return result::ERROR;
-        }
+        region tail(remove_r.end(), r->end() - remove_r.end(), r->file_id, removed_offset + remove_r.size);
+        add_to_table(&tail);
+        insert_region(tail);
     }
     if (r->base != remove_r.base) {
         DR_ASSERT(r->base < remove_r.base);
-        auto new_size = remove_r.base - r->base;
-        auto start = reinterpret_cast<app_pc>(r->base);
-        if (result::ERROR == replace_region(start, new_size, PROT_READ | PROT_WRITE)) {
-            return result::ERROR;
-        }
+        region head(r->base, remove_r.base - r->base, r->file_id, r->offset);
+        add_to_table(&head);
+        insert_region(head);
     }
 
 #if MEM_REGION_LOGGING
@@ -227,64 +536,136 @@ result mem_region_manager::remove_region(app_pc base, size_t size) {
                reinterpret_cast<uintptr_t>(base) + size);
 #endif
 
-    dr_global_free(r, sizeof(*r));
     return result::SUCCESS;
 }
 
-result mem_region_manager::persist_new_region_table() {
-    int fd = my_openat(pmem_dirfd, NEW_TABLE_FILE_NAME, O_CREAT | O_WRONLY);
-    DR_ASSERT_MSG(fd >= 0, "open new region table file failed");
-
-    for (uint i = 0; i < regions.entries; i++) {
-        auto r = static_cast<const region *>(regions.array[i]);
-        int written = my_write(fd, r, sizeof(*r));
-        DR_ASSERT_MSG(written >= 0, "persist_new_region_table: write failed");
-        DR_ASSERT_MSG(written == sizeof(*r), "persist_new_region_table: written less than asked");
+// Flushes the cache lines overlapping [addr, addr + len).
+static void flush_range(const void *addr, size_t len) {
+    constexpr uintptr_t CACHE_LINE_B = 64;
+    const auto end = reinterpret_cast<uintptr_t>(addr) + len;
+    for (uintptr_t p = reinterpret_cast<uintptr_t>(addr) & ~(CACHE_LINE_B - 1); p < end; p += CACHE_LINE_B) {
+        pmem_flush(reinterpret_cast<const void *>(p));
     }
+}
 
-    if (my_fsync(fd) < 0) {
-        DR_ASSERT_MSG(false, "persist_new_region_table: fsync(fd) failed");
+// Maps the region table file, creating it (empty) if it doesn't exist.
+void mem_region_manager::map_table() {
+    int fd = my_openat(pmem_dirfd, TABLE_FILE_NAME, O_CREAT | O_RDWR, 0666);
+    DR_ASSERT_MSG(fd >= 0, "open region table file failed");
+
+    struct stat st;
+    int ret = my_fstat(fd, &st);
+    DR_ASSERT_MSG(ret == 0, "stat region table file failed");
+    if (static_cast<size_t>(st.st_size) != sizeof(region_table)) { // New (or from an incompatible version).
+        bool success = my_ftruncate(fd, 0) == 0 && my_ftruncate(fd, sizeof(region_table)) == 0 &&
+                       my_fsync(fd) == 0 && my_fsync(pmem_dirfd) == 0;
+        DR_ASSERT_MSG(success, "initialize region table file failed");
     }
 
+    void *mem = my_mmap(nullptr, sizeof(region_table), PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, fd,
+                        /* offset */ 0);
+    DR_ASSERT_MSG(reinterpret_cast<uintptr_t>(mem) <= -4096UL, "mmap region table file failed");
+    table = static_cast<region_table *>(mem);
+
     if (my_close(fd) < 0) {
-        DR_ASSERT_MSG(false, "close new region table file failed");
+        DR_ASSERT_MSG(false, "close region table file failed");
     }
+}
 
-    if (my_fsync(pmem_dirfd) < 0) {
-        DR_ASSERT_MSG(false, "persist_new_region_table: fsync(pmem_dirfd) failed");
+// Makes the inactive bitmap a copy of the active one (i.e., no changes yet).
+void mem_region_manager::reset_working_bitmap() {
+    const uint64_t *active = table->valid[active_bitmap()];
+    uint64_t *working = table->valid[1 - active_bitmap()];
+    for (uint i = 0; i < MAX_SLOTS / 64; i++) {
+        if (working[i] != active[i]) {
+            working[i] = active[i];
+            pmem_flush(&working[i]);
+        }
     }
+    working_ready = true;
+}
 
-    return result::SUCCESS;
+// Before the first change to a table that hasn't been recovered (or committed), i.e., when starting afresh,
+// empties the inactive bitmap.
+void mem_region_manager::prepare_working_bitmap() {
+    if (working_ready) {
+        return;
+    }
+    DR_ASSERT(num_regions == 0);
+    table->state &= region_table::ACTIVE_MASK;
+    pmem_flush(&table->state);
+    uint64_t *working = table->valid[1 - active_bitmap()];
+    for (uint i = 0; i < MAX_SLOTS / 64; i++) {
+        if (working[i] != 0) {
+            working[i] = 0;
+            pmem_flush(&working[i]);
+        }
+    }
+    working_ready = true;
 }
 
-result mem_region_manager::commit_new_region_table() {
-    if (int ret = my_renameat(pmem_dirfd, NEW_TABLE_FILE_NAME, pmem_dirfd, CURRENT_TABLE_FILE_NAME); ret < 0) {
-        if (ret == -ENOENT) {
-            // There is nothing to commit.
-            return result::SUCCESS;
+// Writes `r` to a slot that's free in both bitmaps, and sets `r->slot`.  Flushed but not drained.
+void mem_region_manager::add_to_table(region *r) {
+    prepare_working_bitmap();
+    const uint64_t *active = table->valid[active_bitmap()];
+    uint64_t *working = table->valid[1 - active_bitmap()];
+
+    constexpr uint NUM_WORDS = MAX_SLOTS / 64;
+    for (uint n = 0; n < NUM_WORDS; n++) {
+        uint i = (next_slot / 64 + n) % NUM_WORDS;
+        uint64_t free = ~(active[i] | working[i]);
+        if (free == 0) {
+            continue;
         }
-        print_error("commit_new_region_table -- renameat", -ret);
-        return result::ERROR;
+        uint slot = i * 64 + __builtin_ctzll(free);
+        r->slot = slot;
+        table->slots[slot] = *r;
+        flush_range(&table->slots[slot], sizeof(region));
+        working[i] |= 1ull << (slot % 64);
+        pmem_flush(&working[i]);
+        next_slot = (slot + 1) % MAX_SLOTS;
+        return;
     }
-    if (int ret = my_fsync(pmem_dirfd); ret < 0) {
-        print_error("commit_new_region_table -- fsync(pmem_dirfd)", -ret);
-        return result::ERROR;
+    DR_ASSERT_MSG(false, "region table full");
+}
+
+// Flushed but not drained.
+void mem_region_manager::remove_from_table(const region *r) {
+    prepare_working_bitmap();
+    uint64_t *word = &table->valid[1 - active_bitmap()][r->slot / 64];
+    *word &= ~(1ull << (r->slot % 64));
+    pmem_flush(word);
+}
+
+result mem_region_manager::persist_new_region_table() {
+    prepare_working_bitmap();
+    // Order the slot and bitmap updates before the flag.
+    pmem_drain();
+    table->state = active_bitmap() | region_table::PREPARED_MASK;
+    pmem_flush(&table->state);
+    pmem_drain();
+    return result::SUCCESS;
+}
+
+result mem_region_manager::commit_new_region_table() {
+    if (!(table->state & region_table::PREPARED_MASK)) {
+        // There is nothing to commit.
+        return result::SUCCESS;
     }
+    // Switch bitmaps and clear the flag in one atomic store.
+    table->state = 1 - active_bitmap();
+    pmem_flush(&table->state);
+    pmem_drain();
+
+    release_pending_free();
+    reset_working_bitmap();
     return result::SUCCESS;
 }
 
 result mem_region_manager::clear_new_region_table() {
-    if (int ret = my_unlinkat(pmem_dirfd, NEW_TABLE_FILE_NAME, /* flags */ 0); ret < 0) {
-        if (ret == -ENOENT) {
-            // There is nothing to commit.
-            return result::SUCCESS;
-        }
-        print_error("clear_new_region_table -- unlink", -ret);
-        return result::ERROR;
-    }
-    if (int ret = my_fsync(pmem_dirfd); ret < 0) {
-        print_error("clear_new_region_table -- fsync(pmem_dirfd)", -ret);
-        return result::ERROR;
-    }
+    table->state = active_bitmap();
+    pmem_flush(&table->state);
+    pmem_drain();
+    reset_working_bitmap();
     return result::SUCCESS;
 }
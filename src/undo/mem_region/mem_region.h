@@ -4,11 +4,19 @@
 #include <cstddef>
 #include <string>
 
-#include "drvector.h"
+#include <sys/mman.h>
 
 #include "common.h"
+#include "page_map.h"
 #include "ranges.h"
 
+// Manages the memory regions backed by non-volatile memory.  Regions are carved out of a few large, sparse
+// arena files (rather than getting a file each), so replacing or removing a region seldom touches file system
+// metadata; the region table records each region's arena and offset.
+//
+// The region table lives in persistent memory and is updated in place: each region is a slot, and two bitmaps
+// of valid slots take turns being the committed ("active") one.  Changes go to the slots that are free in both
+// bitmaps and to the other bitmap, which becomes active with one atomic store at commit.
 class mem_region_manager {
   public:
     enum class result : int {
@@ -30,41 +38,125 @@ class mem_region_manager {
     void send_regions(int fd) const;
 
     // Replaces a memory region with one backed by non-volatile memory.  Content is preserved.
+    // If `is_zero`, the region is known to be all zeros (e.g., a new anonymous mapping), so nothing is copied.
     // Only returns result::SUCCESS or result::ERROR.
-    result replace_region(app_pc base, size_t size, int prot);
+    result replace_region(app_pc base, size_t size, int prot, bool is_zero = false);
 
-    // Removes a memory region if it is managed by us.
-    // TODO(zhangwen): currently only supports unmapping from a beginning of
-    //      an existing region.
+    // Removes a memory region (or part of one) if it is managed by us.  The rest of the region is kept in
+    // place, and the removed part's arena space is reclaimed after the next commit.
+    // TODO(zhangwen): doesn't support unmapping across regions.
     result remove_region(app_pc base, size_t size);
 
     bool does_manage(app_pc addr) const;
 
+    // Marks the unmanaged pages in [base, base + size) to be replaced lazily, i.e., by `replace_lazy` when
+    // they're about to be written to.  Until then, their content is captured by the initial checkpoint.
+    void add_lazy_region(app_pc base, size_t size);
+
+    [[nodiscard]] bool is_lazy(uintptr_t addr, size_t size) const { return lazy.test_any(addr, size); }
+
+    // Replaces the lazy pages in the chunks (of LAZY_CHUNK_B bytes) overlapping [addr, addr + size),
+    // calling `on_replaced` on each newly replaced range.
+    // Only returns result::SUCCESS or result::ERROR.
+    result replace_lazy(uintptr_t addr, size_t size, void (*on_replaced)(app_pc base, size_t size));
+
+    // The pages in managed regions.
+    [[nodiscard]] const page_map &managed_pages() const { return pages; }
+
+    // The pages to be replaced lazily.
+    [[nodiscard]] const page_map &lazy_pages() const { return lazy; }
+
+    // Calls `f` on every managed region (in order of address).
+    template <typename F> void foreach_region(F f) const {
+        for (uint i = 0; i < num_regions; i++) {
+            f(regions[i]);
+        }
+    }
+
     // Persist the new (modified) region table.  After this function returns, can commit.
     result persist_new_region_table();
 
-    // Commit and clear the new region table.  No-op if there's no new region table.
+    // Commit the new region table, if one has been persisted.
+    // Arena space freed since the previous commit becomes reusable.
     result commit_new_region_table();
 
-    // Clear the new region table.  No-op if there's no new region table.
+    // Discard the new region table (persisted or not).
     result clear_new_region_table();
 
   private:
-    static constexpr const char *CURRENT_TABLE_FILE_NAME = "table.dat";
-    static constexpr const char *NEW_TABLE_FILE_NAME = "new_table.dat";
+    static constexpr const char *TABLE_FILE_NAME = "region_table.dat";
+    static constexpr uint MAX_SLOTS = 1u << 16u;
+    static constexpr uintptr_t LAZY_CHUNK_B = 2u << 20u;
+    // Arena files are sparse, so they're sized generously.  A region can't span arenas.
+    static constexpr uint64_t ARENA_SIZE_B = 256ul << 30u;
+    static constexpr int MAX_ARENAS = 64;
+
+    // The persistent region table.
+    struct region_table {
+        static constexpr uint64_t ACTIVE_MASK = 1;   // Which bitmap is active.
+        static constexpr uint64_t PREPARED_MASK = 2; // Whether the other bitmap is ready to become active.
+
+        alignas(64) uint64_t state;
+        alignas(64) uint64_t valid[2][MAX_SLOTS / 64];
+        alignas(64) region slots[MAX_SLOTS];
+    };
 
     const char *const pmem_path;
     const int pmem_dirfd;
-    drvector_t regions; // of regions.
-
-    ranges<uintptr_t> rs;
-
-    int persist_region(app_pc base, size_t size, char *file_name) const;
+    // The managed regions (each of which is also in `table->slots`), sorted by base, and disjoint.
+    region *regions; // Array of `regions_capacity`.
+    uint num_regions;
+    uint regions_capacity;
+    region_table *table;
+    uint next_slot;      // Where the search for a free slot starts.
+    bool working_ready;  // Whether the inactive bitmap has been set up for changes (see `prepare_working_bitmap`).
+
+    page_map pages;
+    page_map lazy;
+    int arena_fds[MAX_ARENAS];
+    int num_arenas;
+    // Arena space is addressed by position: `file_id * ARENA_SIZE_B + offset`.
+    ranges<uint64_t> free_space; // All holes (i.e., zeros).
+    // Space freed since the previous commit; the committed region table might still refer to it.
+    ranges<uint64_t> pending_free;
+
+    [[nodiscard]] bool open_arenas();
+    [[nodiscard]] bool add_arena();
+    [[nodiscard]] bool alloc_space(size_t size, uint64_t *pos);
+    void release_pending_free();
+    [[nodiscard]] bool punch_hole(uint64_t pos, size_t size);
+    [[nodiscard]] bool persist_region(app_pc base, size_t size, uint64_t pos) const;
+
+    [[nodiscard]] int active_bitmap() const { return static_cast<int>(table->state & region_table::ACTIVE_MASK); }
+    void map_table();
+    void add_to_table(region *r);
+    void remove_from_table(const region *r);
+    void reset_working_bitmap();
+    void prepare_working_bitmap();
 
     // Returns the index of a region that overlaps with the specified region,
     // or -1 if not found.
     [[nodiscard]]
     int find_overlap(const region &other) const;
+    // Returns the index of the first region whose base is at or after `addr`.
+    [[nodiscard]] uint lower_bound(const char *addr) const;
+    void insert_region(const region &r);
+    void erase_region(uint i);
 };
 
+// Converts DynamoRIO memory protection bits (DR_MEMPROT_*) to mmap ones (PROT_*).
+inline int to_mmap_prot(uint dr_prot) {
+    int prot = 0;
+    if (dr_prot & DR_MEMPROT_READ) {
+        prot |= PROT_READ;
+    }
+    if (dr_prot & DR_MEMPROT_WRITE) {
+        prot |= PROT_WRITE;
+    }
+    if (dr_prot & DR_MEMPROT_EXEC) {
+        prot |= PROT_EXEC;
+    }
+    return prot;
+}
+
 #endif // PSM_SRC_UNDO_MEM_REGION_MEM_REGION_H
@@ -0,0 +1,134 @@
+#ifndef PSM_SRC_UNDO_MEM_REGION_PAGE_MAP_H
+#define PSM_SRC_UNDO_MEM_REGION_PAGE_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "dr_api.h"
+
+// A set of pages, stored as a two-level bitmap over the 47-bit user address space: a table of
+// pointers to leaves, each of which is a bitmap of the pages in 1 GiB.  Leaves are allocated
+// when a page in them is first added, and a missing leaf means no page in it is in the set.
+//
+// Lookups take a couple of loads and no branching on the number of ranges, so they can be
+// inlined into instrumentation code (see `ul::undo_insert_page_map_test`).
+class page_map {
+  public:
+    static constexpr int PAGE_SHIFT = 12;
+    static constexpr int LEAF_SHIFT = 30;
+    static constexpr int ADDR_BITS = 47;
+    static constexpr size_t NUM_LEAVES = 1ul << (ADDR_BITS - LEAF_SHIFT);
+    static constexpr size_t PAGES_PER_LEAF = 1ul << (LEAF_SHIFT - PAGE_SHIFT);
+    static constexpr size_t LEAF_SIZE_B = PAGES_PER_LEAF / 8;
+
+    page_map() : leaves(static_cast<uint64_t **>(dr_global_alloc(sizeof(uint64_t *) * NUM_LEAVES))) {
+        memset(leaves, 0, sizeof(uint64_t *) * NUM_LEAVES);
+    }
+
+    ~page_map() {
+        for (size_t i = 0; i < NUM_LEAVES; i++) {
+            if (leaves[i] != nullptr) {
+                dr_global_free(leaves[i], LEAF_SIZE_B);
+            }
+        }
+        dr_global_free(leaves, sizeof(uint64_t *) * NUM_LEAVES);
+    }
+
+    page_map(const page_map &) = delete;
+    page_map &operator=(const page_map &) = delete;
+
+    // Adds every page overlapping [start, start + size).
+    void insert(uintptr_t start, size_t size) { update(start, size, true); }
+
+    // Removes every page overlapping [start, start + size).
+    void remove(uintptr_t start, size_t size) { update(start, size, false); }
+
+    // Returns whether the page containing `addr` is in the set.
+    [[nodiscard]] bool test(uintptr_t addr) const {
+        size_t leaf_idx = addr >> LEAF_SHIFT;
+        if (leaf_idx >= NUM_LEAVES || leaves[leaf_idx] == nullptr) {
+            return false;
+        }
+        size_t page = (addr >> PAGE_SHIFT) & (PAGES_PER_LEAF - 1);
+        return leaves[leaf_idx][page / 64] & (1ull << (page % 64));
+    }
+
+    // Returns whether any page overlapping [start, start + size) is in the set.
+    [[nodiscard]] bool test_any(uintptr_t start, size_t size) const {
+        if (size == 0) {
+            return false;
+        }
+        for (uintptr_t page = start >> PAGE_SHIFT, last = (start + size - 1) >> PAGE_SHIFT; page <= last; page++) {
+            if (test(page << PAGE_SHIFT)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Calls `f(start, size)` on each maximal part of [start, start + size) whose pages are all in the set, in order.
+    template <typename F> void foreach_run(uintptr_t start, size_t size, F f) const {
+        const uintptr_t end = start + size;
+        uintptr_t p = start;
+        while (p < end) {
+            uintptr_t run_end = ((p >> PAGE_SHIFT) + 1) << PAGE_SHIFT;
+            if (!test(p)) {
+                p = run_end;
+                continue;
+            }
+            for (; run_end < end && test(run_end); run_end += 1ul << PAGE_SHIFT)
+                ;
+            run_end = run_end < end ? run_end : end;
+            f(p, run_end - p);
+            p = run_end;
+        }
+    }
+
+    // The leaf table, for instrumentation code to index into.  Its address never changes.
+    [[nodiscard]] uint64_t *const *leaf_table() const { return leaves; }
+
+  private:
+    uint64_t **leaves; // Array of NUM_LEAVES; each non-null entry is a bitmap of PAGES_PER_LEAF bits.
+
+    void update(uintptr_t start, size_t size, bool value) {
+        if (size == 0) {
+            return;
+        }
+        uintptr_t page = start >> PAGE_SHIFT;
+        const uintptr_t last = (start + size - 1) >> PAGE_SHIFT;
+        DR_ASSERT_MSG((last << PAGE_SHIFT) >> LEAF_SHIFT < NUM_LEAVES, "page_map: address out of range");
+
+        while (page <= last) {
+            size_t leaf_idx = page / PAGES_PER_LEAF;
+            size_t first_in_leaf = page % PAGES_PER_LEAF;
+            size_t last_in_leaf = last / PAGES_PER_LEAF == leaf_idx ? last % PAGES_PER_LEAF : PAGES_PER_LEAF - 1;
+
+            uint64_t *leaf = leaves[leaf_idx];
+            if (leaf == nullptr && value) {
+                leaf = leaves[leaf_idx] = static_cast<uint64_t *>(dr_global_alloc(LEAF_SIZE_B));
+                memset(leaf, 0, LEAF_SIZE_B);
+            }
+            if (leaf != nullptr) {
+                update_bits(leaf, first_in_leaf, last_in_leaf, value);
+            }
+            page += last_in_leaf - first_in_leaf + 1;
+        }
+    }
+
+    // Sets (or clears) bits [first, last].
+    static void update_bits(uint64_t *bits, size_t first, size_t last, bool value) {
+        for (size_t w = first / 64; w <= last / 64; w++) {
+            uint64_t mask = ~0ull;
+            if (w == first / 64) {
+                mask &= ~0ull << (first % 64);
+            }
+            if (w == last / 64) {
+                mask &= ~0ull >> (63 - last % 64);
+            }
+            bits[w] = value ? bits[w] | mask : bits[w] & ~mask;
+        }
+    }
+};
+
+#endif // PSM_SRC_UNDO_MEM_REGION_PAGE_MAP_H
@@ -88,21 +88,21 @@ template <typename T> class ranges {
 
         for (uint i = 0; i < v.entries; i++) {
             auto curr = static_cast<const range *>(v.array[i]);
-            if (curr->includes(to_remove.start)) {
+            if (!curr->intersects(to_remove)) { // Untouched.
+                drvector_append(&new_v, new_range(*curr));
+                continue;
+            }
+            if (curr->start < to_remove.start) {
                 const range left{curr->start, to_remove.start - curr->start};
-                if (left.size > 0) {
-                    DR_ASSERT(curr->includes(left));
-                    DR_ASSERT(!left.intersects(to_remove));
-                    drvector_append(&new_v, new_range(left));
-                }
+                DR_ASSERT(curr->includes(left));
+                DR_ASSERT(!left.intersects(to_remove));
+                drvector_append(&new_v, new_range(left));
             }
-            if (curr->includes(to_remove.end() - 1)) {
+            if (to_remove.end() < curr->end()) {
                 const range right{to_remove.end(), curr->end() - to_remove.end()};
-                if (right.size > 0) {
-                    DR_ASSERT(curr->includes(right));
-                    DR_ASSERT(!right.intersects(to_remove));
-                    drvector_append(&new_v, new_range(right));
-                }
+                DR_ASSERT(curr->includes(right));
+                DR_ASSERT(!right.intersects(to_remove));
+                drvector_append(&new_v, new_range(right));
             }
         }
 
@@ -110,7 +110,12 @@ template <typename T> class ranges {
         v = new_v;
     }
 
-    void clear() { v.entries = 0; }
+    void clear() {
+        for (uint i = 0; i < v.entries; i++) {
+            free_range(v.array[i]);
+        }
+        v.entries = 0;
+    }
 
     template <typename F> void foreach (F f) const {
         for (uint i = 0; i < v.entries; i++) {
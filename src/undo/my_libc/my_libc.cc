@@ -1,5 +1,8 @@
 #include "my_libc.h"
 
+#include <csignal>
+
+#include <linux/sched.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 
@@ -103,6 +106,14 @@ ssize_t my_read(int fd, void *buf, size_t count) {
     return syscall(SYS_read, fd, reinterpret_cast<ssize_t>(buf), count);
 }
 
+ssize_t my_pread(int fd, void *buf, size_t count, off_t offset) {
+    return syscall(SYS_pread64, fd, reinterpret_cast<ssize_t>(buf), count, offset);
+}
+
+off_t my_lseek(int fd, off_t offset, int whence) {
+    return syscall(SYS_lseek, fd, offset, whence);
+}
+
 int my_renameat(int olddirfd, const char *oldpath, int newdirfd,
                 const char *newpath) {
     return syscall(SYS_renameat, olddirfd, reinterpret_cast<ssize_t>(oldpath),
@@ -120,6 +131,10 @@ int my_munmap(void *addr, size_t length) {
     return syscall(SYS_munmap, reinterpret_cast<ssize_t>(addr), length);
 }
 
+int my_madvise(void *addr, size_t length, int advice) {
+    return syscall(SYS_madvise, reinterpret_cast<ssize_t>(addr), length, advice);
+}
+
 int my_dup2(int oldfd, int newfd) {
     return syscall(SYS_dup2, oldfd, newfd);
 }
@@ -140,3 +155,66 @@ int my_fstat(int fd, struct stat *statbuf) {
     return syscall(SYS_fstat, fd, reinterpret_cast<ssize_t>(statbuf));
 }
 
+int my_rt_sigprocmask(int how, const sigset_t *set, sigset_t *oldset) {
+    // The kernel's sigset_t is 8 bytes, unlike glibc's.
+    return syscall(SYS_rt_sigprocmask, how, reinterpret_cast<ssize_t>(set),
+                   reinterpret_cast<ssize_t>(oldset), /* sigsetsize */ 8);
+}
+
+int my_fallocate(int fd, int mode, off_t offset, off_t len) {
+    return syscall(SYS_fallocate, fd, mode, offset, len);
+}
+
+int my_getrlimit(int resource, struct rlimit *rlim) {
+    return syscall(SYS_getrlimit, resource, reinterpret_cast<ssize_t>(rlim));
+}
+
+// The child starts here (on its own stack, which holds `fn` and `arg`), with
+// all signals blocked (see `my_clone_thread`).
+extern "C" [[gnu::used, noreturn]] void my_clone_thread_entry(
+        void (*fn)(void *), void *arg) {
+    fn(arg);
+    syscall(SYS_exit, 0);
+    __builtin_unreachable();
+}
+
+int my_clone_thread(void (*fn)(void *), void *arg, void *stack_top,
+                    volatile int *tid) {
+    constexpr ssize_t flags = CLONE_VM | CLONE_FS | CLONE_FILES |
+                              CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM |
+                              CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+
+    auto sp = static_cast<void **>(stack_top);
+    *--sp = arg;
+    *--sp = reinterpret_cast<void *>(fn);
+
+    // The child inherits the signal mask, so blocking all signals here means
+    // that none is ever delivered to a thread that DynamoRIO doesn't know
+    // about (and whose TLS is the parent's), not even as it starts.
+    sigset_t all, old;
+    __builtin_memset(&all, 0xff, sizeof(all));
+    if (int err = my_rt_sigprocmask(SIG_SETMASK, &all, &old); err < 0) {
+        return err;
+    }
+
+    ssize_t ret;
+    register ssize_t child_tid_reg asm(ARG4_REG) = reinterpret_cast<ssize_t>(tid);
+    register ssize_t tls_reg asm(ARG5_REG) = 0;
+    asm volatile("syscall\n\t"
+                 "test %%rax, %%rax\n\t"
+                 "jnz 1f\n\t"
+                 // In the child.
+                 "xor %%ebp, %%ebp\n\t"
+                 "pop %%rdi\n\t"
+                 "pop %%rsi\n\t"
+                 "and $-16, %%rsp\n\t"
+                 "call my_clone_thread_entry\n\t"
+                 "hlt\n\t"
+                 "1:"
+    : "=" ARG_SYSCALL_NUM(ret)
+    : "0"(SYS_clone), ARG1(flags), ARG2(sp), ARG3(tid),
+        "r"(child_tid_reg), "r"(tls_reg)
+    : "cc", "rcx", "r11", "memory");
+    my_rt_sigprocmask(SIG_SETMASK, &old, nullptr);
+    return ret;
+}
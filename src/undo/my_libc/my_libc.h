@@ -1,6 +1,8 @@
 #ifndef PSM_SRC_UNDO_MY_LIBC_MY_LIBC_H
 #define PSM_SRC_UNDO_MY_LIBC_MY_LIBC_H
 
+#include <csignal>
+
 #include <sys/types.h>
 
 #include "prohibit_libc.h"
@@ -11,15 +13,27 @@ int my_open(const char *pathname, int flags, mode_t mode = 0);
 int my_openat(int dirfd, const char *pathname, int flags, mode_t mode = 0);
 int my_unlinkat(int fd, const char *name, int flag);
 int my_ftruncate(int fd, off_t length);
+int my_fallocate(int fd, int mode, off_t offset, off_t len);
 ssize_t my_write(int fd, const void *buf, size_t count);
 ssize_t my_read(int fd, void *buf, size_t count);
+ssize_t my_pread(int fd, void *buf, size_t count, off_t offset);
+off_t my_lseek(int fd, off_t offset, int whence);
 int my_renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath);
 void *my_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
 int my_munmap(void *addr, size_t length);
+int my_madvise(void *addr, size_t length, int advice);
 int my_dup2(int oldfd, int newfd);
 int my_setsid();
 int my_mkdirat(int dirfd, const char *pathname, mode_t mode);
 int my_getdents(int dirfd, void *dirp, int count);
 int my_fstat(int fd, struct stat *statbuf);
+int my_rt_sigprocmask(int how, const sigset_t *set, sigset_t *oldset);
+int my_getrlimit(int resource, struct rlimit *rlim);
+
+// Starts a thread sharing the address space that calls `fn(arg)` on the given
+// stack and then exits.  `*tid` is set to the thread's ID and cleared once the
+// thread has exited.  Returns the thread ID, or a negated errno on failure.
+int my_clone_thread(void (*fn)(void *), void *arg, void *stack_top,
+                    volatile int *tid);
 
 #endif // PSM_SRC_UNDO_MY_LIBC_MY_LIBC_H
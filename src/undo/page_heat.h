@@ -0,0 +1,112 @@
+#ifndef PSM_SRC_UNDO_PAGE_HEAT_H
+#define PSM_SRC_UNDO_PAGE_HEAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "dr_api.h"
+
+#include "flush.h"
+#include "mem_region/common.h"
+#include "mem_region/page_map.h"
+#include "my_libc/my_libc.h"
+
+// An approximate profile of which pages the application writes most, sampled from the undo log at commit.
+// It's persisted every so often, so that after a crash, the foreground can bring back the hottest pages first.
+//
+// Each page hashes to one slot of a small table.  A sampled page bumps its slot's count if it owns the slot,
+// takes the slot over if the count is zero, and otherwise decrements the count (as in the Misra-Gries
+// frequent-items algorithm), so that a slot ends up owned by the page sampled most in it.  Counts are halved
+// whenever the profile is persisted, so the profile follows changes in the working set.
+class page_heat {
+  public:
+    // One in this many logged blocks is sampled.
+    static constexpr uint64_t SAMPLE_PERIOD = 16;
+    // The profile is persisted (and decayed) once every this many commits.
+    static constexpr uint64_t PERSIST_PERIOD = 64;
+
+    // Maps the profile file, creating it if it doesn't exist.  If `recovered`, picks up the persisted profile;
+    // otherwise, starts from scratch.
+    page_heat(const char *pmem_path, bool recovered) : num_sampled(0), num_commits(0) {
+        int dirfd = my_open(pmem_path, O_DIRECTORY);
+        DR_ASSERT_MSG(dirfd >= 0, "open pmem directory failed");
+        int fd = my_openat(dirfd, HEAT_FILE_NAME, O_CREAT | O_RDWR | (recovered ? 0 : O_TRUNC), 0666);
+        DR_ASSERT_MSG(fd >= 0, "open page heat file failed");
+        if (my_close(dirfd) < 0) {
+            DR_ASSERT_MSG(false, "close pmem directory failed");
+        }
+
+        if (my_ftruncate(fd, sizeof(table)) < 0) {
+            DR_ASSERT_MSG(false, "truncate page heat file failed");
+        }
+        void *addr = my_mmap(nullptr, sizeof(table), PROT_READ | PROT_WRITE, MAP_SHARED_VALIDATE | MAP_SYNC, fd,
+                             /* offset */ 0);
+        DR_ASSERT_MSG(addr != MAP_FAILED, "mmap page heat file failed");
+        if (my_close(fd) < 0) {
+            DR_ASSERT_MSG(false, "close page heat file failed");
+        }
+
+        persisted = static_cast<heat_entry *>(addr);
+        memcpy(table, persisted, sizeof(table)); // All zeros unless recovered.
+    }
+
+    ~page_heat() { my_munmap(persisted, sizeof(table)); }
+
+    page_heat(const page_heat &) = delete;
+    page_heat &operator=(const page_heat &) = delete;
+
+    // Counts a write to `addr` (if it's picked as a sample).
+    [[gnu::always_inline]] inline void sample(uintptr_t addr) {
+        if (++num_sampled % SAMPLE_PERIOD != 0) {
+            return;
+        }
+
+        const uint64_t page = addr >> page_map::PAGE_SHIFT << page_map::PAGE_SHIFT;
+        heat_entry &e = table[hash(page)];
+        if (e.page == page) {
+            ++e.count;
+        } else if (e.count == 0) {
+            e.page = page;
+            e.count = 1;
+        } else {
+            --e.count;
+        }
+    }
+
+    // Should be called at every commit.
+    void on_commit() {
+        if (++num_commits % PERSIST_PERIOD != 0) {
+            return;
+        }
+
+        // The profile is only a hint, so it isn't persisted atomically; a crash can leave some entries torn.
+        memcpy(persisted, table, sizeof(table));
+        for (size_t off = 0; off < sizeof(table); off += 64) {
+            pmem_flush(reinterpret_cast<char *>(persisted) + off);
+        }
+        pmem_drain();
+
+        for (heat_entry &e : table) {
+            e.count /= 2;
+        }
+    }
+
+  private:
+    static constexpr int HASH_BITS = 14;
+    static_assert(HEAT_SLOTS == 1u << HASH_BITS, "HASH_BITS doesn't match HEAT_SLOTS");
+
+    static size_t hash(uint64_t page) {
+        return ((page >> page_map::PAGE_SHIFT) * 0x9E3779B97F4A7C15ull) >> (64 - HASH_BITS);
+    }
+
+    heat_entry table[HEAT_SLOTS];
+    heat_entry *persisted; // In persistent memory.
+    uint64_t num_sampled;
+    uint64_t num_commits;
+};
+
+#endif // PSM_SRC_UNDO_PAGE_HEAT_H
@@ -0,0 +1,85 @@
+#ifndef PSM_SRC_UNDO_RAW_THREAD_H
+#define PSM_SRC_UNDO_RAW_THREAD_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/mman.h>
+#include <x86intrin.h>
+
+#include "my_libc/my_libc.h"
+
+// Bare-bones threads for parallelizing work in the background process, where
+// neither libc threads nor DynamoRIO client threads are usable (e.g., during
+// `dr_client_main`, before the application resumes).
+// These threads are invisible to DynamoRIO and run natively, so they must only
+// run PSM code (never application code).
+
+constexpr int MAX_RAW_THREADS = 16;
+constexpr size_t RAW_THREAD_STACK_SIZE_B = 1u << 16u;
+
+struct raw_thread {
+    volatile int tid = 0; // Cleared by the kernel once the thread exits.
+    void *stack = nullptr;
+
+    // Returns false if the thread couldn't be started.
+    bool start(void (*fn)(void *), void *arg) {
+        void *mem = my_mmap(nullptr, RAW_THREAD_STACK_SIZE_B, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1, 0);
+        if (reinterpret_cast<uintptr_t>(mem) > -4096UL) {
+            return false;
+        }
+        stack = mem;
+        if (my_clone_thread(fn, arg, static_cast<char *>(stack) + RAW_THREAD_STACK_SIZE_B, &tid) < 0) {
+            my_munmap(stack, RAW_THREAD_STACK_SIZE_B);
+            stack = nullptr;
+            return false;
+        }
+        return true;
+    }
+
+    void join() {
+        while (tid != 0) {
+            _mm_pause();
+        }
+        my_munmap(stack, RAW_THREAD_STACK_SIZE_B);
+        stack = nullptr;
+    }
+};
+
+// Calls `f(0)`, ..., `f(n - 1)` in parallel and waits for all of them to return.
+// `f(0)` runs on the calling thread.  If a thread can't be started, its share
+// of the work is done on the calling thread instead.
+template <typename F> void run_in_parallel(int n, const F &f) {
+    if (n > MAX_RAW_THREADS) {
+        n = MAX_RAW_THREADS;
+    }
+
+    struct task {
+        const F *f;
+        int i;
+        raw_thread thread;
+        bool started;
+
+        static void run(void *p) {
+            auto t = static_cast<task *>(p);
+            (*t->f)(t->i);
+        }
+    } tasks[MAX_RAW_THREADS];
+
+    for (int i = 1; i < n; i++) {
+        tasks[i].f = &f;
+        tasks[i].i = i;
+        tasks[i].started = tasks[i].thread.start(task::run, &tasks[i]);
+    }
+    f(0);
+    for (int i = 1; i < n; i++) {
+        if (tasks[i].started) {
+            tasks[i].thread.join();
+        } else {
+            f(i);
+        }
+    }
+}
+
+#endif // PSM_SRC_UNDO_RAW_THREAD_H
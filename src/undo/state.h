@@ -2,10 +2,13 @@
 #define PSM_SRC_UNDO_STATE_H
 
 #include <csetjmp>
+#include <cstddef>
 
 constexpr int PIPE_READ_END = 0;
 constexpr int PIPE_WRITE_END = 1;
 
+constexpr int MAX_VOLATILE_REGIONS = 16;
+
 typedef struct {
     const char *pmem_path;
     void *psm_log_base;
@@ -18,6 +21,13 @@ typedef struct {
     int recovered_tail;
 
     bool should_commit;
+
+    // Registered through `psm_volatile_region` before `psm_init`; left alone by the background.
+    struct {
+        void *addr;
+        size_t len;
+    } volatile_regions[MAX_VOLATILE_REGIONS];
+    int num_volatile_regions;
 } instrument_args_t;
 
 extern instrument_args_t instrument_args;
@@ -2,6 +2,7 @@
 #define PSM_SRC_UNDO_UNDO_BG_H
 
 #include <csetjmp>
+#include <cstddef>
 
 #include "state.h"
 
@@ -16,10 +17,39 @@
 #define MOCK_OUT_RECORD_WRITE 0
 
 #define OPTIMIZE_SKIP_STACK 1
-#define OPTIMIZE_DEDUPLICATE 0
-#define OPTIMIZE_SKIP_RECORD 0
+#define OPTIMIZE_DEDUPLICATE 1
+// Record writes in inlined code where possible, falling back to a clean call.
+#define OPTIMIZE_SKIP_RECORD 1
+// Pick the undo block size of each memory region based on its write pattern.
+#define OPTIMIZE_ADAPTIVE_BLK_SIZE 1
+// Log all-zero blocks without copying them, packing runs of them into one undo log entry.
+#define OPTIMIZE_COMPRESS_ZERO_BLK 1
+// Record the writes of a basic block in groups, each followed by a single persistence fence
+// (instead of one fence per write).
+#define OPTIMIZE_BATCH_FENCE 1
+// Buffer the writes that miss the inlined fast path, and record them with one clean call per group.
+#define OPTIMIZE_TRACE_BUFFER 1
+// Record the destination of `rep stos` and `rep movs` as one range, instead of expanding them into loops.
+#define OPTIMIZE_REP_STRING_RANGE 1
+// Record the destination of the application's memcpy/memmove/memset as one range, and run them natively.
+#define OPTIMIZE_WRAP_BULK_FUNCS 1
+// Check a page bitmap of managed (and fresh) memory before recording a write, so that writes to unmanaged
+// memory are dropped early (and, in the inlined fast path, writes to fresh memory don't disable it).
+#define OPTIMIZE_MANAGED_PAGE_FILTER 1
+// Treat heap objects allocated since the previous commit as fresh (see `undo_log_record_fresh_region`).
+#define OPTIMIZE_FRESH_HEAP_OBJECTS 1
+// Replace memory regions with persistent ones on first write (in chunks), rather than all at startup.
+#define OPTIMIZE_LAZY_REPLACE 1
+// Keep a persistent profile of the hottest pages, so that recovery can restore them first.
+#define OPTIMIZE_HEAT_PROFILE 1
 
 static_assert(!OPTIMIZE_SKIP_RECORD || OPTIMIZE_DEDUPLICATE, "OPTIMIZE_SKIP_RECORD requires OPTIMIZE_DEDUPLICATE");
+// The inlined fast path doesn't drain; it relies on the fence after each group.
+static_assert(!OPTIMIZE_SKIP_RECORD || OPTIMIZE_BATCH_FENCE, "OPTIMIZE_SKIP_RECORD requires OPTIMIZE_BATCH_FENCE");
+static_assert(!OPTIMIZE_TRACE_BUFFER || OPTIMIZE_BATCH_FENCE, "OPTIMIZE_TRACE_BUFFER requires OPTIMIZE_BATCH_FENCE");
+// Writes to regions not yet replaced must not be recorded (e.g., by the inlined fast path) before replacement.
+static_assert(!OPTIMIZE_LAZY_REPLACE || OPTIMIZE_MANAGED_PAGE_FILTER,
+              "OPTIMIZE_LAZY_REPLACE requires OPTIMIZE_MANAGED_PAGE_FILTER");
 
 static inline void assert_not_instrumented() {
 #if ENABLE_ASSERT_NOT_INSTRUMENTED
@@ -33,6 +63,7 @@ int instrument_init();
 void instrument_commit(int tail);
 void instrument_cleanup();
 void instrument_log(const char *fmt, ...);
+void instrument_declare_write(void *addr, size_t len);
 
 int take_initial_chkpt(jmp_buf recovery_point);
 
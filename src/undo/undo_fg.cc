@@ -1,10 +1,37 @@
 #include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <unistd.h>
 
 #include "mem_region/fg.h"
 #include "state.h"
 
+// Closes `recv_fd`, and tells the background that the foreground is done with the region files.
+static int tell_background_done(int recv_fd) {
+    if (close(recv_fd) != 0) {
+        return errno;
+    }
+
+    int send_fd = instrument_args.recovery_fds_ftb[PIPE_WRITE_END];
+    const char buf = '\0';
+    int nwritten = write(send_fd, &buf, 1);
+    if (nwritten < 0) {
+        return errno;
+    }
+    if (nwritten < 1) {
+        return EINVAL;
+    }
+    if (close(send_fd) != 0) {
+        return errno;
+    }
+    return 0;
+}
+
 int undo_recover_foreground(int *p_tail) {
     if (!instrument_args.recovered) {
         return 0;
@@ -29,21 +56,36 @@ int undo_recover_foreground(int *p_tail) {
     if ((size_t)nread < sizeof(recovered_tail)) {
         return EINVAL;
     }
-    if (close(recv_fd) != 0) {
-        return errno;
-    }
 
-    int send_fd = instrument_args.recovery_fds_ftb[PIPE_WRITE_END];
-    const char buf = '\0';
-    int nwritten = write(send_fd, &buf, 1);
-    if (nwritten < 0) {
-        return errno;
+    std::vector<region> regions;
+    ret = read_recovered_regions(recv_fd, &regions);
+    if (ret != 0) {
+        return ret;
     }
-    if (nwritten < 1) {
-        return EINVAL;
+
+    // The regions are mapped copy-on-write from their files, so recovery can proceed once the hottest pages have
+    // been brought in; the rest are copied in the background (if that's safe; see `can_warm_concurrently`).
+    // The background waits to modify the files until every page has been copied.
+    ret = warm_hot_pages(instrument_args.pmem_path, regions);
+    if (ret != 0) {
+        return ret;
     }
-    if (close(send_fd) != 0) {
-        return errno;
+    if (can_warm_concurrently()) {
+        std::thread([recv_fd, regions = std::move(regions)]() {
+            warm_recovered_regions(regions);
+            int ret = tell_background_done(recv_fd);
+            if (ret != 0) {
+                fprintf(stderr, "[fg: undo_recover_foreground] warming up recovered regions failed: %s\n",
+                        strerror(ret));
+                abort();
+            }
+        }).detach();
+    } else {
+        warm_recovered_regions(regions);
+        ret = tell_background_done(recv_fd);
+        if (ret != 0) {
+            return ret;
+        }
     }
 
     if (recovered_tail != -1) {
@@ -5,20 +5,30 @@
 #include <cstddef>
 #include <cstring>
 #include <fcntl.h>
+#include <immintrin.h>
 #include <sys/mman.h>
 
 #include "dr_api.h"
 
+#include "blk_size_policy.h"
 #include "flush.h"
+#include "fresh_regions.h"
 #include "mem_region/mem_region.h"
 #include "mem_region/ranges.h"
 #include "my_libc/my_libc.h"
+#include "page_heat.h"
+#include "raw_thread.h"
 #include "undo_bg.h"
 
 // Singleton undo log.
 namespace ul {
 
+// The default (and largest) block size.  With OPTIMIZE_ADAPTIVE_BLK_SIZE, each region picks its own
+// block size among `blk_size_policy::BLK_SIZES_B`.
 constexpr size_t UNDO_BLK_SIZE_B = 32;
+constexpr size_t UNDO_MIN_BLK_SIZE_B = blk_size_policy::BLK_SIZES_B[0];
+static_assert(blk_size_policy::BLK_SIZES_B[blk_size_policy::DEFAULT_BLK_SIZE_IDX] == UNDO_BLK_SIZE_B,
+              "the default block size should be UNDO_BLK_SIZE_B");
 constexpr size_t UNDO_NUM_ENTRIES = 1024 * 512;
 
 #define OPTIMIZED 1
@@ -28,14 +38,42 @@ constexpr size_t LOGGED_ADDR_HASH_SIZE = 16384;
 
 // Commit when undo log length exceeds this threshold.
 constexpr int COMMIT_THRESHOLD = LOGGED_ADDR_HASH_SIZE / 2;
+// Writes of up to this many bytes that might straddle blocks are checked inline, one block at a time
+// (see `undo_insert_block_probes`).
+constexpr uint FAST_PATH_MAX_PROBED_B = 256;
+
+enum class entry_kind : uint16_t {
+    COPY = 0, // `blk` holds the original content of the block at `addr`.
+    // The blocks at `addr` and `extra_addrs[0..num_extra)` were all zero; `blk` holds no content.
+    // This saves copying the content, and lets a run of zero blocks share a single entry.
+    ZERO = 1,
+};
 
 struct alignas(CACHE_LINE_SIZE_B) undo_log_entry {
-    // TODO(zhangwen): this is a waste of space.
-    char blk[UNDO_BLK_SIZE_B];
+    static constexpr uint16_t MAX_EXTRA_ADDRS = UNDO_BLK_SIZE_B / sizeof(app_pc);
+
+    union {
+        // TODO(zhangwen): this is a waste of space.
+        char blk[UNDO_BLK_SIZE_B];
+        app_pc extra_addrs[MAX_EXTRA_ADDRS];
+    };
     app_pc addr;
     uint64_t commit_tail; /* If > 0, this is a commit record and `commit_tail - 1` is the tail. */
+    uint32_t blk_size;    // Size of each block logged by this entry.
+    entry_kind kind;
+    uint16_t num_extra; // Only used by ZERO entries.
 
     [[nodiscard]] bool is_null() const { return addr == nullptr && commit_tail == 0; }
+
+    // Calls `f` on the address of every block logged by this (non-commit) entry.
+    template <typename F> void foreach_addr(F f) const {
+        f(addr);
+        if (kind == entry_kind::ZERO) {
+            for (uint16_t i = 0; i < num_extra; i++) {
+                f(extra_addrs[i]);
+            }
+        }
+    }
 };
 static_assert(sizeof(undo_log_entry) == CACHE_LINE_SIZE_B, "undo_log_entry has different size from cache line");
 
@@ -49,7 +87,31 @@ static struct {
     void **logged_addrs_hash;
 #endif
 
-    ranges<uintptr_t> *fresh_regions;
+    fresh_regions *fresh;
+
+#if OPTIMIZE_MANAGED_PAGE_FILTER
+    const page_map *managed_pages; // Owned by the memory region manager.
+#endif
+#if OPTIMIZE_LAZY_REPLACE
+    const page_map *lazy_pages; // Owned by the memory region manager.
+#endif
+
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    blk_size_policy *blk_sizes;
+#endif
+#if OPTIMIZE_HEAT_PROFILE
+    page_heat *heat;
+#endif
+
+#if OPTIMIZE_SKIP_RECORD
+    // Whether the inlined fast path (see `undo_insert_fast_path`) may record writes, i.e., (unless it checks
+    // `fresh_pages`) there are no fresh regions.
+    bool inline_record_ok;
+#endif
+#if OPTIMIZE_BATCH_FENCE
+    // Whether log entries might have been flushed since the last fence (see `undo_insert_group_fence`).
+    bool needs_fence;
+#endif
 } undo_log;
 
 #define barrier() asm volatile("" ::: "memory")
@@ -87,16 +149,17 @@ static void *map_undo_log(const char *pmem_path) {
 // If the address already exists, returns false.
 // Otherwise, inserts the address if there's space, and returns true.
 // Returns false if the address already exists, true otherwise.
+// `BLK` is the block size for `addr`.
 #if OPTIMIZE_DEDUPLICATE
-static bool undo_log_insert_logged_addr(void *addr) {
+template <size_t BLK> static bool undo_log_insert_logged_addr(void *addr) {
     auto addr_n = reinterpret_cast<uintptr_t>(addr);
 #if !OPTIMIZED
-    DR_ASSERT(addr_n % UNDO_BLK_SIZE_B == 0);
+    DR_ASSERT(addr_n % BLK == 0);
 #endif
 
     static_assert((LOGGED_ADDR_HASH_SIZE & (LOGGED_ADDR_HASH_SIZE - 1)) == 0,
                   "LOGGED_ADDR_HASH_SIZE is not a power of two");
-    auto hash = addr_n / UNDO_BLK_SIZE_B;
+    auto hash = addr_n / BLK;
 
     size_t i = hash;
     uintptr_t perturb = hash;
@@ -122,13 +185,14 @@ static bool undo_log_insert_logged_addr(void *addr) {
 }
 #endif
 
+// Entries past `undo_log.len` are always zero.
 static void undo_log_clear() {
     pmem_memset(reinterpret_cast<char *>(undo_log.log), 0, undo_log.len * sizeof(undo_log_entry));
     undo_log.len = 0;
 #if OPTIMIZE_DEDUPLICATE
     memset(undo_log.logged_addrs_hash, 0, sizeof(void *) * LOGGED_ADDR_HASH_SIZE);
 #endif
-    undo_log.fresh_regions->clear();
+    undo_log.fresh->clear();
     pmem_drain();
 }
 
@@ -140,14 +204,16 @@ static void undo_log_init(const char *pmem_path, bool recovered) {
     /* Am I supposed to call placement new for this array?  I give up... */
 #if OPTIMIZE_DEDUPLICATE
     undo_log.logged_addrs_hash = (void **)dr_global_alloc(sizeof(*undo_log.logged_addrs_hash) * LOGGED_ADDR_HASH_SIZE);
-    /* We should have configured DynamoRIO to allocate in the lowest 4GB of the
-     * address space, making it easier to access this array from vmcode. */
-    DR_ASSERT_MSG(reinterpret_cast<uintptr_t>(undo_log.logged_addrs_hash) < 0xFFFFFFFF,
-                  "logged_addrs_hash address exceeds 32 bits");
 #endif
 
-    void *mem = dr_global_alloc(sizeof(*undo_log.fresh_regions));
-    undo_log.fresh_regions = new (mem) ranges<uintptr_t>();
+    void *mem = dr_global_alloc(sizeof(*undo_log.fresh));
+    undo_log.fresh = new (mem) fresh_regions();
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    undo_log.blk_sizes = new (dr_global_alloc(sizeof(*undo_log.blk_sizes))) blk_size_policy();
+#endif
+#if OPTIMIZE_HEAT_PROFILE
+    undo_log.heat = new (dr_global_alloc(sizeof(*undo_log.heat))) page_heat(pmem_path, recovered);
+#endif
 
     if (recovered) { // Recover other fields.
 #if OPTIMIZE_DEDUPLICATE
@@ -155,9 +221,6 @@ static void undo_log_init(const char *pmem_path, bool recovered) {
 #endif
         int i = 0;
         for (auto entry = undo_log.log; !entry->is_null(); ++entry, ++i) {
-#if OPTIMIZE_DEDUPLICATE
-            undo_log_insert_logged_addr(entry->addr);
-#endif
             if (entry->commit_tail > 0) {
                 DR_ASSERT(entry->addr == nullptr);
             }
@@ -168,36 +231,78 @@ static void undo_log_init(const char *pmem_path, bool recovered) {
     }
 }
 
-// Records memory write to [addr, addr + size).
-// Returns `true` if it's time to commit; as soon as this function returns true,
-// should commit as soon as possible, ignoring the return value of future calls
-// to this function until commit.
-[[gnu::always_inline]] static inline bool undo_log_record
-#if INSTRUMENT_LOGGING
-    (uintptr_t addr, uint size, uintptr_t pc)
-#else
-    (uintptr_t addr, uint size)
-#endif
-{
-    if (undo_log.fresh_regions->find(addr, size)) {
-        // This region was newly allocated after the previous commit.
-        // No need to save the original value for undo.
-#if INSTRUMENT_LOGGING
-        dr_fprintf(STDERR, "[bg: undo_log_record] fresh: %p\t%u\t%p\n", addr, size, pc);
-#endif
-        return false;
+template <size_t BLK> [[gnu::always_inline]] static inline bool is_zero_blk(const void *p) {
+    if constexpr (BLK == 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v == 0;
+    } else if constexpr (BLK == 16) {
+        __m128i v = _mm_loadu_si128(static_cast<const __m128i *>(p));
+        return _mm_testz_si128(v, v);
+    } else {
+        static_assert(BLK == 32, "unsupported block size");
+        __m256i v = _mm256_loadu_si256(static_cast<const __m256i *>(p));
+        return _mm256_testz_si256(v, v);
+    }
+}
+
+// Undo-logs an all-zero block.  If the previous entry is a ZERO entry with room to spare, the block
+// is added to it; this is safe because that entry is the newest one, so it can't make a younger
+// entry for the same block look older than it is.
+[[gnu::always_inline]] static inline void undo_log_record_zero_blk(app_pc p, uint32_t blk_size) {
+    if (undo_log.len > 0) {
+        undo_log_entry *tail = &undo_log.log[undo_log.len - 1];
+        if (tail->kind == entry_kind::ZERO && tail->blk_size == blk_size &&
+            tail->num_extra < undo_log_entry::MAX_EXTRA_ADDRS) {
+            // The following writes are to the same cache line and are thus ordered.
+            tail->extra_addrs[tail->num_extra] = p;
+            barrier();
+            tail->num_extra++;
+            pmem_flush(tail);
+            return;
+        }
     }
 
-    static_assert((UNDO_BLK_SIZE_B & (UNDO_BLK_SIZE_B - 1)) == 0, "UNDO_BLK_SIZE_B is not a power of two");
-    uintptr_t blk_start = addr & ~(UNDO_BLK_SIZE_B - 1);
-    for (auto pn = blk_start; pn < addr + size; pn += UNDO_BLK_SIZE_B) {
+    auto *entry = static_cast<undo_log_entry *>(
+        __builtin_assume_aligned(&undo_log.log[undo_log.len], CACHE_LINE_SIZE_B));
+    entry->blk_size = blk_size;
+    entry->kind = entry_kind::ZERO;
+    entry->num_extra = 0;
+    barrier();
+    entry->addr = p;
+    barrier();
+    entry->commit_tail = 0;
+    pmem_flush(entry);
+    undo_log.len++;
 #if !OPTIMIZED
-        DR_ASSERT(pn % UNDO_BLK_SIZE_B == 0);
+    DR_ASSERT(undo_log.len < UNDO_NUM_ENTRIES);
+#endif
+}
+
+// Undo-logs the blocks of size `BLK` overlapping [addr, addr + size).
+template <size_t BLK>
+[[gnu::always_inline]] static inline void undo_log_record_blocks(uintptr_t addr, size_t size, uintptr_t pc) {
+    static_assert((BLK & (BLK - 1)) == 0, "block size is not a power of two");
+    static_assert(BLK <= sizeof(undo_log_entry::blk), "block doesn't fit in an undo log entry");
+    uintptr_t blk_start = addr & ~(BLK - 1);
+    for (auto pn = blk_start; pn < addr + size; pn += BLK) {
+#if !OPTIMIZED
+        DR_ASSERT(pn % BLK == 0);
 #endif
 
         auto p = reinterpret_cast<app_pc>(pn);
 #if OPTIMIZE_DEDUPLICATE
-        if (!undo_log_insert_logged_addr(p)) {
+        if (!undo_log_insert_logged_addr<BLK>(p)) {
+            continue;
+        }
+#endif
+
+#if OPTIMIZE_COMPRESS_ZERO_BLK
+        if (is_zero_blk<BLK>(p)) {
+            undo_log_record_zero_blk(p, BLK);
+#if INSTRUMENT_LOGGING
+            dr_fprintf(STDERR, "[bg: undo_log_record] zero: %p\t%lu\t%p\n", p, BLK, pc);
+#endif
             continue;
         }
 #endif
@@ -208,44 +313,128 @@ static void undo_log_init(const char *pmem_path, bool recovered) {
             __builtin_assume_aligned(&undo_log.log[undo_log.len], CACHE_LINE_SIZE_B));
 
         // The following writes are to the same cache line and are thus ordered.
-        memcpy(entry->blk, p, UNDO_BLK_SIZE_B);
+        memcpy(entry->blk, p, BLK);
+        entry->blk_size = BLK;
+        entry->kind = entry_kind::COPY;
         barrier();
         entry->addr = p;
         barrier();
         entry->commit_tail = 0;
         pmem_flush(entry);
         // We don't care about the order in which these log entries get
-        // persisted, as long as they all get persisted by the end of this
-        // function.
+        // persisted, as long as they all get persisted before the write.
         undo_log.len++;
 #if !OPTIMIZED
         DR_ASSERT(undo_log.len < UNDO_NUM_ENTRIES);
 #endif
 
 #if INSTRUMENT_LOGGING
-        dr_fprintf(STDERR, "[bg: undo_log_record] %p\t%p\n", p, pc);
+        dr_fprintf(STDERR, "[bg: undo_log_record] %p\t%lu\t%p\n", p, BLK, pc);
 #endif
     }
-    pmem_drain();
+}
+
+// Records memory write to [addr, addr + size).
+// The new log entries are flushed but not drained; the caller must `pmem_drain()`
+// before the write takes place (possibly after recording other writes).
+// Returns `true` if it's time to commit; as soon as this function returns true,
+// should commit as soon as possible, ignoring the return value of future calls
+// to this function until commit.
+[[gnu::always_inline]] static inline bool undo_log_record_managed(uintptr_t addr, size_t size, uintptr_t pc);
+
+[[gnu::always_inline]] static inline bool undo_log_record
+#if INSTRUMENT_LOGGING
+    (uintptr_t addr, size_t size, uintptr_t pc)
+#else
+    (uintptr_t addr, size_t size)
+#endif
+{
+#if !INSTRUMENT_LOGGING
+    constexpr uintptr_t pc = 0;
+#endif
+#if OPTIMIZE_MANAGED_PAGE_FILTER
+    // Memory that isn't ours (e.g., shared memory left alone by the memory region manager, the stack, or volatile
+    // memory) isn't restored by recovery, so it must not be logged.  A range (e.g., from a rep string or a bulk
+    // function) can cover both, so only its managed parts are recorded.
+    if (size > 0 && ((addr ^ (addr + size - 1)) >> page_map::PAGE_SHIFT) == 0) { // Within one page.
+        return undo_log.managed_pages->test(addr) && undo_log_record_managed(addr, size, pc);
+    }
+    bool should_commit = false;
+    undo_log.managed_pages->foreach_run(addr, size, [&should_commit, pc](uintptr_t start, size_t len) {
+        should_commit |= undo_log_record_managed(start, len, pc);
+    });
+    return should_commit;
+#else
+    return undo_log_record_managed(addr, size, pc);
+#endif
+}
+
+// Records memory write to [addr, addr + size), which is all managed (see `undo_log_record`).
+[[gnu::always_inline]] static inline bool undo_log_record_managed(uintptr_t addr, size_t size, uintptr_t pc) {
+    if (auto *r = undo_log.fresh->find(addr, size)) {
+        // This region was newly allocated after the previous commit.
+        // No need to save the original value for undo; just remember to flush the lines at commit.
+        fresh_regions::mark_dirty(r, addr, size);
+#if INSTRUMENT_LOGGING
+        dr_fprintf(STDERR, "[bg: undo_log_record] fresh: %p\t%lu\t%p\n", addr, size, pc);
+#endif
+        return false;
+    }
+#if OPTIMIZE_BATCH_FENCE
+    undo_log.needs_fence = true;
+#endif
+
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    // Regions have their own block sizes, so a range is recorded one region at a time; otherwise, its blocks could
+    // partially overlap the ones logged for a neighbouring region.  Regions are page-aligned, so blocks in the gap
+    // between regions can't reach into them either.
+    while (size > 0) {
+        size_t seg_size = size;
+        int blk_size_idx = blk_size_policy::DEFAULT_BLK_SIZE_IDX;
+        if (auto *r = undo_log.blk_sizes->find_segment(addr, &seg_size)) {
+            blk_size_idx = r->blk_size_idx;
+        }
+        static_assert(blk_size_policy::NUM_BLK_SIZES == 3, "update the switch below");
+        switch (blk_size_idx) {
+        case 0:
+            undo_log_record_blocks<blk_size_policy::BLK_SIZES_B[0]>(addr, seg_size, pc);
+            break;
+        case 1:
+            undo_log_record_blocks<blk_size_policy::BLK_SIZES_B[1]>(addr, seg_size, pc);
+            break;
+        default:
+            undo_log_record_blocks<blk_size_policy::BLK_SIZES_B[2]>(addr, seg_size, pc);
+            break;
+        }
+        addr += seg_size;
+        size -= seg_size;
+    }
+#else
+    undo_log_record_blocks<UNDO_BLK_SIZE_B>(addr, size, pc);
+#endif
     return undo_log.len > COMMIT_THRESHOLD;
 }
 
 // Records newly allocated memory [addr, addr + size).
 // Writes to this region will not be logged till the next "commit".
-// Upon commit, all this memory is flushed.
+// Upon commit, the lines written to in this memory are flushed.
 // This is an optimization; it is not necessary to call this function
 // for all new memory.
-static void undo_log_record_fresh_region(app_pc addr, uint size) {
-    undo_log.fresh_regions->insert(reinterpret_cast<uintptr_t>(addr), size);
+static void undo_log_record_fresh_region(app_pc addr, size_t size) {
+    undo_log.fresh->insert(reinterpret_cast<uintptr_t>(addr), size);
+#if OPTIMIZE_SKIP_RECORD && !OPTIMIZE_MANAGED_PAGE_FILTER
+    // The fast path doesn't know about fresh regions.
+    undo_log.inline_record_ok = false;
+#endif
 #if INSTRUMENT_LOGGING
-    dr_fprintf(STDERR, "[bg: undo_log_record_fresh_region] recorded fresh region\t%p\t%u\n", addr, size);
+    dr_fprintf(STDERR, "[bg: undo_log_record_fresh_region] recorded fresh region\t%p\t%lu\n", addr, size);
 #endif
 }
 
-static void undo_log_remove_fresh_region(app_pc addr, uint size) {
-    undo_log.fresh_regions->remove(reinterpret_cast<uintptr_t>(addr), size);
+static void undo_log_remove_fresh_region(app_pc addr, size_t size) {
+    undo_log.fresh->remove(reinterpret_cast<uintptr_t>(addr), size);
 #if INSTRUMENT_LOGGING
-    dr_fprintf(STDERR, "[bg: undo_log_remove_fresh_region] removed fresh region\t%p\t%u\n", addr, size);
+    dr_fprintf(STDERR, "[bg: undo_log_remove_fresh_region] removed fresh region\t%p\t%lu\n", addr, size);
 #endif
 }
 
@@ -254,17 +443,18 @@ static void undo_log_commit(int tail) {
     static_assert(CACHE_LINE_SIZE_B % UNDO_BLK_SIZE_B == 0, "undo-logged block straddles cache line");
 
     for (size_t i = 0; i < undo_log.len; i++) {
-        pmem_flush(undo_log.log[i].addr);
+        undo_log.log[i].foreach_addr([](app_pc addr) {
+            pmem_flush(addr);
+#if OPTIMIZE_HEAT_PROFILE
+            undo_log.heat->sample(reinterpret_cast<uintptr_t>(addr));
+#endif
+        });
     }
-    undo_log.fresh_regions->foreach ([](uintptr_t addr_n, size_t size) {
-        auto addr = reinterpret_cast<app_pc>(addr_n);
-        pmem_flush(addr);
-        uintptr_t blk_start = addr_n & ~(CACHE_LINE_SIZE_B - 1);
-
-        for (auto p = reinterpret_cast<app_pc>(blk_start) + CACHE_LINE_SIZE_B; p < addr + size;
-             p += CACHE_LINE_SIZE_B) {
-            pmem_flush(p);
-        }
+    undo_log.fresh->foreach_dirty_line([](uintptr_t line) {
+        pmem_flush(reinterpret_cast<void *>(line));
+#if OPTIMIZE_HEAT_PROFILE
+        undo_log.heat->sample(line);
+#endif
     });
     pmem_drain();
 
@@ -276,12 +466,23 @@ static void undo_log_commit(int tail) {
     undo_log.len++;
     DR_ASSERT(undo_log.len < UNDO_NUM_ENTRIES);
     pmem_drain();
+#if OPTIMIZE_HEAT_PROFILE
+    undo_log.heat->on_commit();
+#endif
 
 #if INSTRUMENT_LOGGING
     dr_fprintf(STDERR, "[bg: instrument_commit] undo_log_len:\t%d\n", undo_log.len);
 #endif
 }
 
+// Should be called when there are no fresh regions (e.g., right after the undo log is cleared), or when the
+// fast path checks for them itself.
+static void undo_log_update_inline_record_ok() {
+#if OPTIMIZE_SKIP_RECORD
+    undo_log.inline_record_ok = true;
+#endif
+}
+
 static void undo_log_post_commit_cleanup() {
     // TODO(zhangwen): this is a horrible name.
 #if INSTRUMENT_LOGGING
@@ -294,16 +495,142 @@ static void undo_log_post_commit_cleanup() {
     // Precondition: the last record must be a commit record.
     DR_ASSERT(undo_log.len > 0);
     DR_ASSERT(undo_log.log[undo_log.len - 1].commit_tail > 0);
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    for (size_t i = 0; i < undo_log.len; i++) {
+        const undo_log_entry &entry = undo_log.log[i];
+        if (entry.commit_tail > 0) {
+            continue;
+        }
+        const void *original = entry.kind == entry_kind::COPY ? entry.blk : nullptr;
+        entry.foreach_addr([&entry, original](app_pc addr) {
+            undo_log.blk_sizes->sample(reinterpret_cast<uintptr_t>(addr), entry.blk_size, original);
+        });
+    }
+#endif
     undo_log_clear();
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    // The undo log is empty, so block sizes can change.
+    undo_log.blk_sizes->adapt();
+#endif
+    undo_log_update_inline_record_ok();
+}
+
+// Should be called whenever the set of managed regions has changed, while the undo log is empty.
+static void undo_log_reset_regions(const mem_region_manager *mrm) {
+#if OPTIMIZE_MANAGED_PAGE_FILTER
+    undo_log.managed_pages = &mrm->managed_pages();
+#endif
+#if OPTIMIZE_LAZY_REPLACE
+    undo_log.lazy_pages = &mrm->lazy_pages();
+#endif
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    undo_log.blk_sizes->reset_regions(*mrm);
+#endif
+    undo_log_update_inline_record_ok();
 }
 
 static void undo_log_exit() {
     size_t undo_log_size = sizeof(undo_log_entry) * UNDO_NUM_ENTRIES;
     my_munmap(undo_log.log, undo_log_size);
+#if OPTIMIZE_HEAT_PROFILE
+    undo_log.heat->~page_heat();
+    dr_global_free(undo_log.heat, sizeof(*undo_log.heat));
+#endif
+}
+
+// Recovery applies log entries using up to this many threads.
+constexpr int RECOVERY_THREADS = 8;
+// Logs with fewer entries than this are applied by a single thread.
+constexpr size_t PARALLEL_RECOVERY_MIN_ENTRIES = 4096;
+
+// Restores the block at `addr`, which is logged by `entry`.
+static void undo_log_apply_entry(const undo_log_entry *entry, app_pc addr) {
+    if (entry->kind == entry_kind::ZERO) {
+        memset(addr, 0, entry->blk_size);
+    } else {
+        memcpy(addr, &entry->blk, entry->blk_size);
+    }
+    pmem_flush(addr);
+#if INSTRUMENT_LOGGING
+    dr_fprintf(STDERR, "[bg: apply_undo_log] applied undo log entry: %p\n", addr);
+#endif
+}
+
+// Applies the (uncommitted) undo log.
+// A block may be logged more than once, but only its oldest entry (holding its
+// content as of the last commit) matters.  So, we first build a map from block
+// address to its oldest entry, and then apply the surviving entries in parallel;
+// since they are for distinct blocks, the order doesn't matter.
+static void undo_log_apply_oldest(const mem_region_manager *mrm) {
+    if (undo_log.len == 0) {
+        return;
+    }
+
+    struct slot {
+        app_pc addr;
+        const undo_log_entry *entry;
+    };
+    // A ZERO entry can log more than one block.
+    size_t num_blks = 0;
+    for (size_t i = 0; i < undo_log.len; i++) {
+        undo_log.log[i].foreach_addr([&num_blks](app_pc) { ++num_blks; });
+    }
+    uint slot_bits = 1;
+    while ((1ull << slot_bits) < 2 * num_blks) {
+        ++slot_bits;
+    }
+    const size_t num_slots = 1ull << slot_bits;
+    const size_t map_size = num_slots * sizeof(slot);
+    // Fresh anonymous memory is zeroed, i.e., all slots are empty.
+    auto map = static_cast<slot *>(
+        my_mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, /* offset */ 0));
+    DR_ASSERT_MSG(reinterpret_cast<uintptr_t>(map) <= -4096UL, "mmap recovery map failed");
+
+    size_t num_survivors = 0;
+    for (size_t i = 0; i < undo_log.len; i++) {
+        const undo_log_entry *entry = &undo_log.log[i];
+        DR_ASSERT_MSG(entry->commit_tail == 0, "there should be no commit entry");
+
+        entry->foreach_addr([&](app_pc addr) {
+            DR_ASSERT_MSG(addr != nullptr, "entry->addr == nullptr");
+            // Writes to newly allocated regions should have been filtered out.
+            DR_ASSERT_MSG(mrm->does_manage(addr), "undo log entry addr not in a managed region?");
+
+            // Fibonacci hashing; linear probing.
+            // Blocks logged since the last commit all have the same size and are aligned to it, so they're
+            // either identical or disjoint.
+            size_t j = (reinterpret_cast<uintptr_t>(addr) / UNDO_MIN_BLK_SIZE_B * 0x9E3779B97F4A7C15ull) >>
+                       (64 - slot_bits);
+            for (; map[j].addr != nullptr && map[j].addr != addr; j = (j + 1) & (num_slots - 1))
+                ;
+            if (map[j].addr == nullptr) { // The oldest entry for `addr`; later ones are ignored.
+                map[j] = {addr, entry};
+                ++num_survivors;
+            }
+        });
+    }
+
+    int num_threads = num_survivors < PARALLEL_RECOVERY_MIN_ENTRIES ? 1 : RECOVERY_THREADS;
+    run_in_parallel(num_threads, [map, num_slots, num_threads](int t) {
+        size_t begin = num_slots / num_threads * t;
+        size_t end = t == num_threads - 1 ? num_slots : begin + num_slots / num_threads;
+        for (size_t j = begin; j < end; j++) {
+            if (map[j].addr != nullptr) {
+                undo_log_apply_entry(map[j].entry, map[j].addr);
+            }
+        }
+        // Each thread must wait for its own flushes.
+        pmem_drain();
+    });
+
+#if INSTRUMENT_LOGGING
+    dr_fprintf(STDERR, "[bg: apply_undo_log] applied %lu of %lu blocks\n", num_survivors, num_blks);
+#endif
+    my_munmap(map, map_size);
 }
 
-// Goes through log entries from back to front and applies them until a commit
-// record, then discards the remaining records.
+// If the log ends with a commit record, discards the log; otherwise, applies the
+// log entries (see `undo_log_apply_oldest`).
 // This is valid because all writes captured by the log records before a commit
 // records should have been persisted.
 // Returns the commit tail, or -1 if one doesn't exist. If one exists, it should
@@ -329,22 +656,7 @@ static void undo_log_exit() {
     mrm->clear_new_region_table();
     mrm->recover();
 
-    for (size_t i = undo_log.len; i > 0; --i) {
-        undo_log_entry *entry = &undo_log.log[i - 1];
-        DR_ASSERT_MSG(entry->commit_tail == 0, "there should be no commit entry");
-
-        app_pc addr = entry->addr;
-        DR_ASSERT_MSG(addr != nullptr, "entry->addr == nullptr");
-        // Writes to newly allocated regions should have been filtered out.
-        DR_ASSERT_MSG(mrm->does_manage(addr), "undo log entry addr not in a managed region?");
-
-        memcpy(entry->addr, &entry->blk, UNDO_BLK_SIZE_B);
-        pmem_flush(entry->addr);
-#if INSTRUMENT_LOGGING
-        dr_fprintf(STDERR, "[bg: apply_undo_log] applied undo log entry: %p\n", addr);
-#endif
-    }
-    pmem_drain();
+    undo_log_apply_oldest(mrm);
 
     undo_log_clear();
 #if INSTRUMENT_LOGGING
@@ -356,98 +668,351 @@ static void undo_log_exit() {
 /* Expects `value` to be a power of 2. */
 constexpr uint8_t log2(size_t value) { return value == 1 ? 0 : 1 + log2(value >> 1u); }
 
+#if OPTIMIZE_BATCH_FENCE
+// Inserts before `where` the fence that persists the log entries flushed for a group of writes, skipped if
+// there are none (e.g., every block written had been logged already).
+// Clobbers `reg` and the arithmetic flags.
+static void undo_insert_group_fence(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t reg) {
+    using undo_log_t = decltype(undo_log);
+    instr_t *done_label = INSTR_CREATE_label(drcontext);
+    // movq &undo_log, %reg
+    instrlist_meta_preinsert(ilist, where,
+                             INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg),
+                                                  OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(&undo_log))));
+    // cmpb $0, needs_fence(%reg); je DONE
+    instrlist_meta_preinsert(ilist, where,
+                             INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM8(reg, offsetof(undo_log_t, needs_fence)),
+                                              OPND_CREATE_INT8(0)));
+    instrlist_meta_preinsert(ilist, where, INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(done_label)));
+    // sfence; movb $0, needs_fence(%reg)
+    instrlist_meta_preinsert(ilist, where, INSTR_CREATE_sfence(drcontext));
+    instrlist_meta_preinsert(ilist, where,
+                             INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM8(reg, offsetof(undo_log_t, needs_fence)),
+                                                 OPND_CREATE_INT8(0)));
+    instrlist_meta_preinsert(ilist, where, done_label);
+}
+#endif
+
 #if OPTIMIZE_SKIP_RECORD
 #define MINSERT instrlist_meta_preinsert
-static void undo_insert_fast_path(void *drcontext, instrlist_t *ilist, instr_t *where, uint size,
-                                  instr_t *slow_path_label, instr_t *skip_label, reg_id_t reg_dst, reg_id_t reg_t1) {
-    // The code here is based on assembly generated by Clang.
-    // Alignment check: use slow path if write straddles blocks.
-    if (size > 32) {
-        return;
+// Inserts before `where` a test of whether the page containing the address in `reg_dst` is in `map`, which
+// jumps to `set_label` if so, or to `clear_label` otherwise.  Either label can be null, meaning fall through.
+// Clobbers `reg_t1`, `reg_t2`, and the arithmetic flags.
+static void undo_insert_page_map_test(void *drcontext, instrlist_t *ilist, instr_t *where, const page_map *map,
+                                      instr_t *set_label, instr_t *clear_label, reg_id_t reg_dst, reg_id_t reg_t1,
+                                      reg_id_t reg_t2) {
+    DR_ASSERT(set_label == nullptr || clear_label == nullptr);
+    instr_t *fall_through = INSTR_CREATE_label(drcontext);
+    if (set_label == nullptr) {
+        set_label = fall_through;
     }
-
-    DR_ASSERT(size > 0 && (size & (size - 1)) == 0);
-    if (size > 1) { // A write of size 1 always passes the check.
-        {           // lea [reg_dst + (size-1)] ==> reg_t1
-            auto opnd1 = opnd_create_reg(reg_t1);
-            auto opnd2 = opnd_create_base_disp(reg_dst, DR_REG_NULL, 0, static_cast<int>(size - 1), OPSZ_lea);
-            auto instr = INSTR_CREATE_lea(drcontext, opnd1, opnd2);
-            MINSERT(ilist, where, instr);
-        }
-
-        { // xor reg_dst, reg_t1
-            auto opnd1 = opnd_create_reg(reg_t1);
-            auto opnd2 = opnd_create_reg(reg_dst);
-            auto instr = INSTR_CREATE_xor(drcontext, opnd1, opnd2);
-            MINSERT(ilist, where, instr);
-        }
-
-        { // cmpq (UNDO_BLK_SIZE_B-1), $reg_t1
-            auto opnd1 = opnd_create_reg(reg_t1);
-            auto opnd2 = OPND_CREATE_INT8(UNDO_BLK_SIZE_B - 1);
-            auto instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
-            MINSERT(ilist, where, instr);
-        }
-
-        { // ja SLOW_PATH
-            auto instr = INSTR_CREATE_jcc_short(drcontext, OP_ja_short, opnd_create_instr(slow_path_label));
-            MINSERT(ilist, where, instr);
-        }
+    if (clear_label == nullptr) {
+        clear_label = fall_through;
     }
 
-    // Check the hash table (with no probing) to see if we're sure the block has
-    // been logged.  If we don't find it at first try, defer to slow path.
-    { // mov %reg_dst, %reg_t1
-        auto opnd1 = opnd_create_reg(reg_t1);
-        auto opnd2 = opnd_create_reg(reg_dst);
-        auto instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-        MINSERT(ilist, where, instr);
+    // %reg_t1 <- leaf index; jump to CLEAR if it's out of range.
+    MINSERT(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_shr(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(page_map::LEAF_SHIFT)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_cmp(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT32(page_map::NUM_LEAVES)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jae, opnd_create_instr(clear_label)));
+    // %reg_t2 <- leaf; jump to CLEAR if it's null.
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg_t2),
+                                 OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(map->leaf_table()))));
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t2),
+                                opnd_create_base_disp(reg_t2, reg_t1, sizeof(void *), 0, OPSZ_PTR)));
+    MINSERT(ilist, where, INSTR_CREATE_test(drcontext, opnd_create_reg(reg_t2), opnd_create_reg(reg_t2)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jz, opnd_create_instr(clear_label)));
+    // %reg_t1 <- page index in the leaf; bt (%reg_t2), %reg_t1
+    MINSERT(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_shr(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(page_map::PAGE_SHIFT)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_and(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT32(page_map::PAGES_PER_LEAF - 1)));
+    MINSERT(ilist, where, INSTR_CREATE_bt(drcontext, OPND_CREATE_MEM64(reg_t2, 0), opnd_create_reg(reg_t1)));
+    if (set_label != fall_through) {
+        MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jb, opnd_create_instr(set_label)));
+    } else {
+        MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jae, opnd_create_instr(clear_label)));
     }
+    MINSERT(ilist, where, fall_through);
+}
 
-    // Compute %reg_t1 <- (%reg_t1/UNDO_BLK_SIZE_B)%LOGGED_ADDR_HASH_SIZE*8.
-    constexpr uint8_t log2_ptr_size = log2(sizeof(void *));
-    constexpr uint8_t log2_UNDO_BLK_SIZE_B = log2(UNDO_BLK_SIZE_B);
+// Inserts before `where` the page checks of `undo_insert_fast_path` for a write (within one page) to the address
+// in `reg_dst`.  Returns the label of the out-of-line lazy-page check (see `undo_insert_lazy_check`), if any.
+// Clobbers `reg_t1`, `reg_t2`, and the arithmetic flags.
+static instr_t *undo_insert_page_filter(void *drcontext, instrlist_t *ilist, instr_t *where, instr_t *slow_path_label,
+                                        instr_t *skip_label, reg_id_t reg_dst, reg_id_t reg_t1, reg_id_t reg_t2) {
+#if OPTIMIZE_MANAGED_PAGE_FILTER
+#if OPTIMIZE_LAZY_REPLACE
+    // Unmanaged pages are checked against the lazy pages, out of line.
+    instr_t *unmanaged_label = INSTR_CREATE_label(drcontext);
+#else
+    instr_t *unmanaged_label = skip_label;
+#endif
+    undo_insert_page_map_test(drcontext, ilist, where, undo_log.managed_pages, /* set_label */ nullptr,
+                              /* clear_label */ unmanaged_label, reg_dst, reg_t1, reg_t2);
+    undo_insert_page_map_test(drcontext, ilist, where, &undo_log.fresh->fresh_pages(), slow_path_label,
+                              /* clear_label */ nullptr, reg_dst, reg_t1, reg_t2);
+#endif
+#if OPTIMIZE_ADAPTIVE_BLK_SIZE
+    // The fast path logs default-size blocks; the slow path handles regions with other block sizes.
+    undo_insert_page_map_test(drcontext, ilist, where, &undo_log.blk_sizes->non_default_pages(), slow_path_label,
+                              /* clear_label */ nullptr, reg_dst, reg_t1, reg_t2);
+#endif
+#if OPTIMIZE_MANAGED_PAGE_FILTER && OPTIMIZE_LAZY_REPLACE
+    return unmanaged_label;
+#else
+    return nullptr;
+#endif
+}
 
-    static_assert(log2_UNDO_BLK_SIZE_B > log2_ptr_size, "UNDO_BLK_SIZE_B <= sizeof(void *)");
-    { // shrq log2(UNDO_BLK_SIZE_B) - log2(ptr_size), %reg_t1
-        auto opnd1 = opnd_create_reg(reg_t1);
-        auto opnd2 = OPND_CREATE_INT8(log2_UNDO_BLK_SIZE_B - log2_ptr_size);
-        auto instr = INSTR_CREATE_shr(drcontext, opnd1, opnd2);
-        MINSERT(ilist, where, instr);
-    }
+// Inserts before `where` the out-of-line check returned by `undo_insert_page_filter` (if any): a write to an
+// unmanaged page that's yet to be replaced jumps to `slow_path_label`, and any other to `skip_label`.
+static void undo_insert_lazy_check(void *drcontext, instrlist_t *ilist, instr_t *where, instr_t *unmanaged_label,
+                                   instr_t *slow_path_label, instr_t *skip_label, reg_id_t reg_dst, reg_id_t reg_t1,
+                                   reg_id_t reg_t2) {
+#if OPTIMIZE_MANAGED_PAGE_FILTER && OPTIMIZE_LAZY_REPLACE
+    MINSERT(ilist, where, unmanaged_label);
+    undo_insert_page_map_test(drcontext, ilist, where, undo_log.lazy_pages, slow_path_label,
+                              /* clear_label */ nullptr, reg_dst, reg_t1, reg_t2);
+    MINSERT(ilist, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(skip_label)));
+#endif
+}
 
-    { // andl 8*(LOGGED_ADDR_HASH_SIZE-1), %reg_t1
-        auto opnd1 = opnd_create_reg(reg_t1);
-        auto opnd2 = OPND_CREATE_INT32((LOGGED_ADDR_HASH_SIZE - 1) * sizeof(void *));
-        auto instr = INSTR_CREATE_and(drcontext, opnd1, opnd2);
-        MINSERT(ilist, where, instr);
-    }
+// Inserts before `where` an inlined check for a write of `size` bytes (at most FAST_PATH_MAX_PROBED_B) to the address
+// in `reg_dst`, which may span several blocks, e.g., a record covering several writes: if every block it overlaps has
+// already been logged and is found in its hash slot, jumps to `skip_label`; otherwise, jumps to `slow_path_label`
+// with `reg_dst` intact.  Nothing is logged inline.  The write must be within one page (otherwise, it takes the slow
+// path), and the page checks are the same as in `undo_insert_fast_path`.
+// Clobbers `reg_t1`, `reg_t2`, and the arithmetic flags.
+static void undo_insert_block_probes(void *drcontext, instrlist_t *ilist, instr_t *where, uint size,
+                                     instr_t *slow_path_label, instr_t *skip_label, reg_id_t reg_dst,
+                                     reg_id_t reg_t1, reg_id_t reg_t2) {
+    constexpr size_t BLK = UNDO_BLK_SIZE_B;
+    using undo_log_t = decltype(undo_log);
+    DR_ASSERT(size > 0 && size <= FAST_PATH_MAX_PROBED_B);
+
+    // lea [reg_dst + (size-1)] ==> reg_t1; xor reg_dst, reg_t1; cmp (PAGE_SIZE-1), reg_t1; ja SLOW_PATH
+    MINSERT(ilist, where,
+            INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_t1),
+                             opnd_create_base_disp(reg_dst, DR_REG_NULL, 0, static_cast<int>(size - 1), OPSZ_lea)));
+    MINSERT(ilist, where, INSTR_CREATE_xor(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_cmp(drcontext, opnd_create_reg(reg_t1),
+                             OPND_CREATE_INT32((1 << page_map::PAGE_SHIFT) - 1)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_ja, opnd_create_instr(slow_path_label)));
+
+    instr_t *unmanaged_label =
+        undo_insert_page_filter(drcontext, ilist, where, slow_path_label, skip_label, reg_dst, reg_t1, reg_t2);
+
+    // movq &undo_log, %reg_t2; cmpb $0, inline_record_ok(%reg_t2); je SLOW_PATH
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg_t2),
+                                 OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(&undo_log))));
+    MINSERT(ilist, where,
+            INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM8(reg_t2, offsetof(undo_log_t, inline_record_ok)),
+                             OPND_CREATE_INT8(0)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(slow_path_label)));
+
+    // The write overlaps at most this many blocks; the `k`-th one is at (%reg_dst & ~(BLK-1)) + k*BLK.
+    const int max_blocks = static_cast<int>((size - 1) / BLK + 2);
+    for (int k = 0; k < max_blocks; k++) {
+        if (k > 0) {
+            // Jump to SKIP if the block is past the last byte written (so all blocks have been found).
+            // lea [reg_dst + (size-1)] ==> reg_t2; %reg_t1 <- block address; cmp %reg_t2, %reg_t1; ja SKIP
+            MINSERT(ilist, where,
+                    INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_t2),
+                                     opnd_create_base_disp(reg_dst, DR_REG_NULL, 0, static_cast<int>(size - 1),
+                                                           OPSZ_lea)));
+            MINSERT(ilist, where,
+                    INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+            MINSERT(ilist, where,
+                    INSTR_CREATE_and(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(-static_cast<int>(BLK))));
+            MINSERT(ilist, where,
+                    INSTR_CREATE_add(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT32(k * static_cast<int>(BLK))));
+            MINSERT(ilist, where, INSTR_CREATE_cmp(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_t2)));
+            MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_ja, opnd_create_instr(skip_label)));
+        }
 
-    { // movq logged_addrs_hash(%reg_t1), %reg_t1
-        auto opnd1 = opnd_create_reg(reg_t1);
-        auto opnd2 = OPND_CREATE_MEMPTR(reg_t1, reinterpret_cast<uintptr_t>(undo_log.logged_addrs_hash));
-        auto instr = INSTR_CREATE_mov_ld(drcontext, opnd1, opnd2);
-        MINSERT(ilist, where, instr);
+        // %reg_t1 <- ((%reg_dst >> log2(BLK)) + k) % LOGGED_ADDR_HASH_SIZE, the block's first hash slot.
+        MINSERT(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+        MINSERT(ilist, where, INSTR_CREATE_shr(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(log2(BLK))));
+        if (k > 0) {
+            MINSERT(ilist, where, INSTR_CREATE_add(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(k)));
+        }
+        MINSERT(ilist, where,
+                INSTR_CREATE_and(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT32(LOGGED_ADDR_HASH_SIZE - 1)));
+        // %reg_t2 <- the address of the slot.
+        MINSERT(ilist, where,
+                INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg_t2),
+                                     OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(&undo_log))));
+        MINSERT(ilist, where,
+                INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t2),
+                                    OPND_CREATE_MEMPTR(reg_t2, offsetof(undo_log_t, logged_addrs_hash))));
+        MINSERT(ilist, where,
+                INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_t2),
+                                 opnd_create_base_disp(reg_t2, reg_t1, sizeof(void *), 0, OPSZ_lea)));
+        // %reg_t1 <- the block address; cmpq %reg_t1, (%reg_t2); jne SLOW_PATH
+        MINSERT(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+        MINSERT(ilist, where,
+                INSTR_CREATE_and(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(-static_cast<int>(BLK))));
+        if (k > 0) {
+            MINSERT(ilist, where,
+                    INSTR_CREATE_add(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT32(k * static_cast<int>(BLK))));
+        }
+        MINSERT(ilist, where, INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEMPTR(reg_t2, 0), opnd_create_reg(reg_t1)));
+        MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jne, opnd_create_instr(slow_path_label)));
     }
+    MINSERT(ilist, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(skip_label)));
+
+    undo_insert_lazy_check(drcontext, ilist, where, unmanaged_label, slow_path_label, skip_label, reg_dst, reg_t1,
+                           reg_t2);
+}
 
-    { // xorq %reg_dst, %reg_t1
-        auto opnd1 = opnd_create_reg(reg_t1);
-        auto opnd2 = opnd_create_reg(reg_dst);
-        auto instr = INSTR_CREATE_xor(drcontext, opnd1, opnd2);
-        MINSERT(ilist, where, instr);
+// Inserts before `where` an inlined `undo_log_record` of a write of `size` bytes to the address in
+// `reg_dst`, which handles the common cases:
+//  (1) The block has already been logged and is found in its hash slot: jumps to `skip_label`.
+//  (2) The hash slot is empty: claims it, appends a log entry (flushed but not drained), and jumps to
+//      `skip_label`.
+// Otherwise (the write straddles blocks, the hash slot is taken by another block, it's almost time
+// to commit, or `undo_log.inline_record_ok` is false), jumps to `slow_path_label` with `reg_dst` intact.
+// With OPTIMIZE_MANAGED_PAGE_FILTER, a write to an unmanaged page jumps to `skip_label` right away, and a
+// write to a fresh page jumps to `slow_path_label` (which marks its line dirty).  With OPTIMIZE_LAZY_REPLACE,
+// a write to an unmanaged page that's yet to be replaced also jumps to `slow_path_label` (which replaces it).
+// With OPTIMIZE_ADAPTIVE_BLK_SIZE, so does a write to a region that doesn't use the default block size.
+// Clobbers `reg_t1`, `reg_t2`, the arithmetic flags, and (when jumping to `skip_label`) `reg_dst`.
+static void undo_insert_fast_path(void *drcontext, instrlist_t *ilist, instr_t *where, uint size,
+                                  instr_t *slow_path_label, instr_t *skip_label, reg_id_t reg_dst, reg_id_t reg_t1,
+                                  reg_id_t reg_t2) {
+    constexpr size_t BLK = UNDO_BLK_SIZE_B;
+    using undo_log_t = decltype(undo_log);
+    static_assert(offsetof(undo_log_entry, blk) == 0, "undo_log_entry::blk is not at the start");
+    static_assert(offsetof(undo_log_entry, kind) == offsetof(undo_log_entry, blk_size) + 4 &&
+                      offsetof(undo_log_entry, num_extra) == offsetof(undo_log_entry, blk_size) + 6,
+                  "undo_log_entry::{blk_size, kind, num_extra} should make up a quadword");
+    static_assert(static_cast<uint16_t>(entry_kind::COPY) == 0, "entry_kind::COPY should be zero");
+
+    if (size > BLK || (size & (size - 1)) != 0) {
+        // Such writes (e.g., records covering several writes) might straddle blocks; they're only checked inline.
+        if (size <= FAST_PATH_MAX_PROBED_B) {
+            undo_insert_block_probes(drcontext, ilist, where, size, slow_path_label, skip_label, reg_dst, reg_t1,
+                                     reg_t2);
+        } else {
+            MINSERT(ilist, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(slow_path_label)));
+        }
+        return;
     }
 
-    { // cmpq UNDO_BLK_SIZE_B, $reg_t1
-        auto opnd1 = opnd_create_reg(reg_t1);
-        auto opnd2 = OPND_CREATE_INT8(UNDO_BLK_SIZE_B);
-        auto instr = INSTR_CREATE_cmp(drcontext, opnd1, opnd2);
-        MINSERT(ilist, where, instr);
+    // Alignment check: use slow path if write straddles blocks.
+    if (size > 1) { // A write of size 1 always passes the check.
+        // lea [reg_dst + (size-1)] ==> reg_t1
+        MINSERT(ilist, where,
+                INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_t1),
+                                 opnd_create_base_disp(reg_dst, DR_REG_NULL, 0, static_cast<int>(size - 1), OPSZ_lea)));
+        // xor reg_dst, reg_t1
+        MINSERT(ilist, where, INSTR_CREATE_xor(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+        // cmpq (BLK-1), $reg_t1
+        MINSERT(ilist, where, INSTR_CREATE_cmp(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(BLK - 1)));
+        // ja SLOW_PATH
+        MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_ja, opnd_create_instr(slow_path_label)));
     }
 
-    { // jb SKIP
-        auto instr = INSTR_CREATE_jcc(drcontext, OP_jb, opnd_create_instr(skip_label));
-        MINSERT(ilist, where, instr);
+    // The write doesn't straddle blocks, so it's within one page.
+    instr_t *unmanaged_label =
+        undo_insert_page_filter(drcontext, ilist, where, slow_path_label, skip_label, reg_dst, reg_t1, reg_t2);
+
+    // movq &undo_log, %reg_t2
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg_t2),
+                                 OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(&undo_log))));
+    // cmpb $0, inline_record_ok(%reg_t2); je SLOW_PATH
+    MINSERT(ilist, where,
+            INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM8(reg_t2, offsetof(undo_log_t, inline_record_ok)),
+                             OPND_CREATE_INT8(0)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(slow_path_label)));
+    // cmpq $COMMIT_THRESHOLD, len(%reg_t2); jae SLOW_PATH
+    // (The slow path tells the caller when it's time to commit.)
+    MINSERT(ilist, where,
+            INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEM64(reg_t2, offsetof(undo_log_t, len)),
+                             OPND_CREATE_INT32(COMMIT_THRESHOLD)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jae, opnd_create_instr(slow_path_label)));
+
+    // Compute the hash slot address: %reg_t2 <- logged_addrs_hash + (%reg_dst/BLK)%LOGGED_ADDR_HASH_SIZE*8.
+    // This is the first slot `undo_log_insert_logged_addr` probes.
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1),
+                                OPND_CREATE_MEMPTR(reg_t2, offsetof(undo_log_t, logged_addrs_hash))));
+    MINSERT(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t2), opnd_create_reg(reg_dst)));
+    MINSERT(ilist, where, INSTR_CREATE_shr(drcontext, opnd_create_reg(reg_t2), OPND_CREATE_INT8(log2(BLK))));
+    MINSERT(ilist, where,
+            INSTR_CREATE_and(drcontext, opnd_create_reg(reg_t2), OPND_CREATE_INT32(LOGGED_ADDR_HASH_SIZE - 1)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_t2),
+                             opnd_create_base_disp(reg_t1, reg_t2, sizeof(void *), 0, OPSZ_lea)));
+
+    // Compute the block address: %reg_t1 <- %reg_dst & ~(BLK-1).
+    MINSERT(ilist, where, INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t1), opnd_create_reg(reg_dst)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_and(drcontext, opnd_create_reg(reg_t1), OPND_CREATE_INT8(-static_cast<int>(BLK))));
+
+    // cmpq %reg_t1, (%reg_t2); je SKIP
+    MINSERT(ilist, where, INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEMPTR(reg_t2, 0), opnd_create_reg(reg_t1)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_je, opnd_create_instr(skip_label)));
+    // cmpq $0, (%reg_t2); jne SLOW_PATH
+    MINSERT(ilist, where, INSTR_CREATE_cmp(drcontext, OPND_CREATE_MEMPTR(reg_t2, 0), OPND_CREATE_INT8(0)));
+    MINSERT(ilist, where, INSTR_CREATE_jcc(drcontext, OP_jne, opnd_create_instr(slow_path_label)));
+
+    // From here on, there's no going back to the slow path, so %reg_dst is free.
+    // movq %reg_t1, (%reg_t2)
+    MINSERT(ilist, where, INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEMPTR(reg_t2, 0), opnd_create_reg(reg_t1)));
+
+    // %reg_t2 <- &log[len++]
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_imm(drcontext, opnd_create_reg(reg_dst),
+                                 OPND_CREATE_INTPTR(reinterpret_cast<ptr_int_t>(&undo_log))));
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_t2),
+                                OPND_CREATE_MEM64(reg_dst, offsetof(undo_log_t, len))));
+    MINSERT(ilist, where,
+            INSTR_CREATE_shl(drcontext, opnd_create_reg(reg_t2), OPND_CREATE_INT8(log2(sizeof(undo_log_entry)))));
+    MINSERT(ilist, where,
+            INSTR_CREATE_add(drcontext, opnd_create_reg(reg_t2),
+                             OPND_CREATE_MEMPTR(reg_dst, offsetof(undo_log_t, log))));
+    MINSERT(ilist, where, INSTR_CREATE_inc(drcontext, OPND_CREATE_MEM64(reg_dst, offsetof(undo_log_t, len))));
+    // movb $1, needs_fence(%reg_dst)
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM8(reg_dst, offsetof(undo_log_t, needs_fence)),
+                                OPND_CREATE_INT8(1)));
+
+    // Same as `undo_log_record_blocks`: the following writes are to the same cache line and are thus ordered.
+    for (int off = 0; off < static_cast<int>(BLK); off += sizeof(uint64_t)) {
+        MINSERT(ilist, where,
+                INSTR_CREATE_mov_ld(drcontext, opnd_create_reg(reg_dst), OPND_CREATE_MEM64(reg_t1, off)));
+        MINSERT(ilist, where,
+                INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM64(reg_t2, off), opnd_create_reg(reg_dst)));
     }
+    // blk_size = BLK, kind = COPY, num_extra = 0.
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM64(reg_t2, offsetof(undo_log_entry, blk_size)),
+                                OPND_CREATE_INT32(BLK)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM64(reg_t2, offsetof(undo_log_entry, commit_tail)),
+                                OPND_CREATE_INT32(0)));
+    MINSERT(ilist, where,
+            INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEMPTR(reg_t2, offsetof(undo_log_entry, addr)),
+                                opnd_create_reg(reg_t1)));
+    // clwb (%reg_t2)
+    MINSERT(ilist, where,
+            INSTR_CREATE_clwb(drcontext, opnd_create_base_disp(reg_t2, DR_REG_NULL, 0, 0, OPSZ_clflush)));
+
+    MINSERT(ilist, where, INSTR_CREATE_jmp(drcontext, opnd_create_instr(skip_label)));
+
+    undo_insert_lazy_check(drcontext, ilist, where, unmanaged_label, slow_path_label, skip_label, reg_dst, reg_t1,
+                           reg_t2);
 }
 #undef MINSERT
 #endif